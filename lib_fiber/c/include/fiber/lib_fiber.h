@@ -21,6 +21,24 @@ typedef struct ACL_FIBER ACL_FIBER;
  */
 void acl_fiber_hook_api(int onoff);
 
+/**
+ * 设置是否使用 io_uring 作为协程的事件引擎，此时被 hook 的读写、accept 及
+ * connect 等 IO 操作将以完成方式直接提交给内核，并在每轮调度中批量提交；
+ * 当内核不支持时（须 5.11 以上）自动使用 epoll，须在协程调度前调用
+ * @param onoff {int} 是否使用 io_uring，内部缺省值为 0
+ */
+void acl_fiber_use_io_uring(int onoff);
+
+/**
+ * 设置处理普通文件 IO 的辅助线程数，协程中被 hook 的普通文件的 open、read、
+ * write、pread、pwrite、fsync 等操作将交给辅助线程执行，当前协程让出直至完成，
+ * 从而避免磁盘 IO 阻塞同一线程中的所有协程；使用 io_uring 事件引擎时普通文件
+ * 的读写直接提交给内核；使用共享栈的协程直接调用系统 API；须在协程中首次进行
+ * 文件 IO 前调用
+ * @param nthreads {int} 辅助线程数，为 0 时直接调用系统 API，内部缺省值为 4
+ */
+void acl_fiber_set_file_threads(int nthreads);
+
 /**
  * 创建一个协程
  * @param fn {void (*)(ACL_FIBER*, void*)} 协程运行时的回调函数地址
@@ -31,6 +49,49 @@ void acl_fiber_hook_api(int onoff);
 ACL_FIBER* acl_fiber_create(void (*fn)(ACL_FIBER*, void*),
 	void* arg, size_t size);
 
+/**
+ * 创建一个使用共享栈的协程，同一线程中的此类协程轮流运行在该线程的共享栈上，
+ * 协程被切换出去后仅将其实际使用的栈内容拷贝保存，从而可以用较少的内存支持
+ * 大量的空闲协程（如大量长连接），但每次切换时会有拷贝栈的开销；协程中不得
+ * 将栈上变量的地址传递给其它协程使用，在 M:N 调度方式下此类协程不会被其它
+ * 线程窃取；仅在 x86_64/aarch64 的 Linux 平台上有效，其它平台将使用大小与
+ * 共享栈相同的独立栈
+ * @param fn {void (*)(ACL_FIBER*, void*)} 协程运行时的回调函数地址
+ * @param arg {void*} 回调 fn 函数时的第二个参数
+ * @return {ACL_FIBER*}
+ */
+ACL_FIBER* acl_fiber_create_shared(void (*fn)(ACL_FIBER*, void*), void* arg);
+
+/**
+ * 设置每个线程的共享栈大小，须在创建使用共享栈的协程前调用
+ * @param size {size_t} 共享栈大小，内部缺省值为 1024000
+ */
+void acl_fiber_set_shared_stack_size(size_t size);
+
+/**
+ * 获得每个线程的共享栈大小
+ * @return {size_t}
+ */
+size_t acl_fiber_get_shared_stack_size(void);
+
+/**
+ * 协程栈通过 mmap 成批分配，协程退出后其栈被放入所有线程共享的栈池中以便
+ * 复用，在池中空闲超过指定时间的栈将通过 madvise(MADV_DONTNEED) 归还物理内存
+ * @param max {int} 每种大小的栈在池中最多保留物理内存的个数，超出的栈放入池中
+ *  时立即归还物理内存，内部缺省值为 1000
+ * @param idle {int} 栈在池中空闲多少秒后归还物理内存，内部缺省值为 10
+ */
+void acl_fiber_stack_pool(int max, int idle);
+
+/**
+ * 设置是否在每个协程栈的底部设置一个不可访问的保护页，从而在栈溢出时进程
+ * 立即崩溃而不是破坏其它内存；因每个保护页会占用一个内存映射，当保护页数
+ * 达到系统内存映射数上限 (vm.max_map_count) 的四分之一时，之后分配的栈将
+ * 不再设置保护页
+ * @param onoff {int} 是否设置保护页，内部缺省值为 1
+ */
+void acl_fiber_stack_guard(int onoff);
+
 /**
  * 返回当前线程中处于消亡状态的协程数
  * @retur {int}
@@ -135,6 +196,19 @@ void acl_fiber_switch(void);
  */
 void acl_fiber_schedule(void);
 
+/**
+ * 以 M:N 方式启动协程调度：由包括当前线程在内的 nthreads 个线程共同运行协程，
+ * 每个线程拥有各自的运行队列及事件引擎，空闲的线程会从其它线程的运行队列中窃取
+ * 就绪的协程，因此协程被唤醒后可能会在另一个线程中继续运行；当所有协程退出或
+ * 调用 acl_fiber_schedule_stop 后本函数返回。
+ * 注：协程可能在线程间迁移，所以在协程中不应使用线程局部变量；协程锁、信号量及
+ * 通道等对象非线程安全，acl_fiber_signal/acl_fiber_kill 也须在目标协程所在的
+ * 线程中调用，所以在该模式下它们不可用于可能运行于不同线程的协程之间；收到信号
+ * 的协程及正处于被 hook 的 poll/select/epoll_wait 中的协程不会被其它线程窃取
+ * @param nthreads {int} 调度线程数，<= 1 时与 acl_fiber_schedule 相同
+ */
+void acl_fiber_schedule_mn(int nthreads);
+
 /**
  * 调用本函数检测当前线程是否处于协程调度状态
  * @return {int} 0 表示非协程状态，非 0 表示处于协程调度状态
@@ -179,12 +253,117 @@ ACL_FIBER* acl_fiber_create_timer(unsigned int milliseconds, size_t size,
 void acl_fiber_reset_timer(ACL_FIBER* timer, unsigned int milliseconds);
 
 /**
- * 本函数设置 DNS 服务器的地址
- * @param ip {const char*} DNS 服务器 IP 地址
+ * 本函数设置 DNS 服务器的地址，被 hook 的 gethostbyname_r/getaddrinfo 将只
+ * 使用该服务器；未设置时从 /etc/resolv.conf 中读取所有的 nameserver
+ * @param ip {const char*} DNS 服务器 IP 地址，为空时恢复使用 resolv.conf
  * @param port {int} DNS 服务器的端口
  */
 void acl_fiber_set_dns(const char* ip, int port);
 
+/**
+ * 添加一个 DNS 服务器（最多 8 个），查询超时或失败时依次尝试下一个服务器
+ * @param ip {const char*} DNS 服务器 IP 地址
+ * @param port {int} DNS 服务器的端口
+ */
+void acl_fiber_add_dns(const char* ip, int port);
+
+/**
+ * 设置每次查询 DNS 服务器的超时时间及对所有服务器的轮询次数，未设置时使用
+ * resolv.conf 中的 options timeout:n attempts:n，缺省为 2 秒和 2 次
+ * @param timeout {int} 每次查询的超时秒数
+ * @param attempts {int} 轮询所有服务器的次数
+ */
+void acl_fiber_dns_set_timeout(int timeout, int attempts);
+
+/**
+ * 设置进程内的域名解析缓存：正常结果按应答中最小的 TTL 缓存（不超过
+ * max_ttl），域名不存在的结果缓存 neg_ttl 秒，查询失败的结果不缓存；同一
+ * 域名同时只有一个查询，其它协程（包括其它线程中的）等待其结果
+ * @param max_ttl {int} 缓存的最大秒数，为 0 时禁止缓存，缺省为 300
+ * @param neg_ttl {int} 域名不存在时的缓存秒数，为 0 时不缓存，缺省为 5
+ * @param max {int} 缓存的最大域名个数，缺省为 10000
+ */
+void acl_fiber_dns_set_cache(int max_ttl, int neg_ttl, int max);
+
+/**
+ * 清除域名解析缓存
+ */
+void acl_fiber_dns_clear(void);
+
+/* for fiber profiling */
+
+/**
+ * 协程的运行统计，时间单位均为纳秒，且仅在 acl_fiber_profile 开启期间计时
+ */
+typedef struct ACL_FIBER_STAT {
+	unsigned int id;		/* 协程 ID 号 */
+	int          status;		/* 协程状态 */
+	int          sys;		/* 是否为内部的系统协程 */
+	size_t       stack_size;	/* 协程栈大小 */
+	unsigned long long nswitch;	/* 被切换运行的次数 */
+	unsigned long long nwait_io;	/* 等待 IO 就绪的次数 */
+	unsigned long long nwait_timer;	/* 调用 acl_fiber_delay 休眠的次数 */
+	long long    run_ns;		/* 运行的时间 */
+	long long    io_ns;		/* 等待 IO 的时间 */
+	long long    timer_ns;		/* 休眠的时间 */
+} ACL_FIBER_STAT;
+
+/**
+ * 线程中协程调度器的统计
+ */
+typedef struct ACL_FIBER_SCHED_STAT {
+	int          nfibers;		/* 存活的用户协程数 */
+	int          nready;		/* 运行队列长度 */
+	int          nwait_io;		/* 等待 IO 的协程数 */
+	int          nsleeping;		/* 休眠中的协程数 */
+	int          ndead;		/* 缓存的消亡协程数 */
+	unsigned long long nswitch;	/* 协程切换的总次数 */
+	unsigned long long nloop;	/* 事件循环等待事件的次数 */
+	long long    sched_ns;		/* 处于调度器上下文中的时间 */
+	long long    idle_ns;		/* 事件循环等待事件的时间 */
+} ACL_FIBER_SCHED_STAT;
+
+/**
+ * 设置是否统计协程的运行时间及等待 IO、休眠的时间，开启后每次协程切换及等待
+ * 时将多读取一次单调时钟；切换、等待的次数始终被统计
+ * @param onoff {int} 是否开启，内部缺省值为 0
+ */
+void acl_fiber_profile(int onoff);
+
+/**
+ * 获得指定协程的运行统计
+ * @param fiber {const ACL_FIBER*} 指定的协程对象，为 NULL 时则使用当前协程
+ * @param stat {ACL_FIBER_STAT*} 存放结果，必须非 NULL
+ * @return {int} 返回 -1 表示没有指定的协程
+ */
+int acl_fiber_stat(const ACL_FIBER* fiber, ACL_FIBER_STAT* stat);
+
+/**
+ * 获得当前线程中所有协程（包括消亡缓存中的）的运行统计快照；在 M:N 调度
+ * 方式下协程不属于某个线程，所以不会被列出
+ * @param stats {ACL_FIBER_STAT*} 存放结果的数组
+ * @param max {int} 数组的元素个数
+ * @return {int} 存入数组的元素个数
+ */
+int acl_fiber_stat_list(ACL_FIBER_STAT* stats, int max);
+
+/**
+ * 获得当前线程中协程调度器的统计快照
+ * @param stat {ACL_FIBER_SCHED_STAT*} 存放结果，必须非 NULL
+ */
+void acl_fiber_sched_stat(ACL_FIBER_SCHED_STAT* stat);
+
+/**
+ * 将当前线程的调度器统计及运行时间最多的前 max 个用户协程以文本方式输出，
+ * 每行一项，用于排查线上占用 CPU 的协程；未开启 acl_fiber_profile 时按切换
+ * 次数排序
+ * @param buf {char*} 存放结果的缓冲区，结果以 '\0' 结尾，超长时被截断
+ * @param size {size_t} buf 的空间大小
+ * @param max {int} 最多输出的协程数
+ * @return {int} 写入 buf 的长度
+ */
+int acl_fiber_stat_top(char* buf, size_t size, int max);
+
 /* for fiber specific */
 
 /**
@@ -481,6 +660,85 @@ int acl_channel_sendul_nb(ACL_CHANNEL* c, unsigned long val);
  */
 unsigned long acl_channel_recvul_nb(ACL_CHANNEL* c);
 
+/* cross-thread channel */
+
+/**
+ * 可在不同线程的协程之间传递对象指针的有界多生产者多消费者管道，队列的槽位
+ * 采用无锁方式读写，仅在队列为空或为满而需要等待时才加锁；等待的协程由其所在
+ * 线程事件循环中的 eventfd 唤醒，不属于任何协程的线程也可以在其上阻塞收发；
+ * 使用共享栈的协程不能使用该管道
+ */
+typedef struct ACL_FIBER_CHAN ACL_FIBER_CHAN;
+
+/**
+ * 创建跨线程的协程通信管道
+ * @param capacity {size_t} 可以缓存的对象个数，内部会向上取整为 2 的幂次方
+ * @return {ACL_FIBER_CHAN*}
+ */
+ACL_FIBER_CHAN* acl_fiber_chan_create(size_t capacity);
+
+/**
+ * 释放由 acl_fiber_chan_create 创建的管道，调用时不得有协程或线程在其上等待
+ * @param chan {ACL_FIBER_CHAN*}
+ */
+void acl_fiber_chan_free(ACL_FIBER_CHAN* chan);
+
+/**
+ * 向管道中发送一个对象指针，管道满时阻塞直至有空闲槽位
+ * @param chan {ACL_FIBER_CHAN*}
+ * @param ptr {void*} 非 NULL 的对象指针
+ * @return {int} 返回 0 表示成功，-1 表示等待时当前协程被杀死
+ */
+int acl_fiber_chan_send(ACL_FIBER_CHAN* chan, void* ptr);
+
+/**
+ * 以非阻塞方式向管道中发送一个对象指针
+ * @param chan {ACL_FIBER_CHAN*}
+ * @param ptr {void*} 非 NULL 的对象指针
+ * @return {int} 返回 0 表示成功，-1 表示管道已满
+ */
+int acl_fiber_chan_trysend(ACL_FIBER_CHAN* chan, void* ptr);
+
+/**
+ * 批量发送对象指针，管道满时阻塞直至全部发送完毕，所有对象发送后最多唤醒一次
+ * 等待的接收者，比逐个发送减少了唤醒的次数
+ * @param chan {ACL_FIBER_CHAN*}
+ * @param ptrs {void**} 非 NULL 的对象指针数组
+ * @param n {int} 数组中对象的个数
+ * @return {int} 返回已发送的个数，小于 n 表示等待时当前协程被杀死
+ */
+int acl_fiber_chan_send_batch(ACL_FIBER_CHAN* chan, void** ptrs, int n);
+
+/**
+ * 从管道中接收一个对象指针，管道空时阻塞直至有对象到达
+ * @param chan {ACL_FIBER_CHAN*}
+ * @return {void*} 返回 NULL 表示等待时当前协程被杀死
+ */
+void* acl_fiber_chan_recv(ACL_FIBER_CHAN* chan);
+
+/**
+ * 以非阻塞方式从管道中接收一个对象指针
+ * @param chan {ACL_FIBER_CHAN*}
+ * @return {void*} 返回 NULL 表示管道为空
+ */
+void* acl_fiber_chan_tryrecv(ACL_FIBER_CHAN* chan);
+
+/**
+ * 批量接收对象指针，管道空时阻塞直至至少收到一个对象
+ * @param chan {ACL_FIBER_CHAN*}
+ * @param ptrs {void**} 存放接收到的对象指针的数组
+ * @param max {int} 数组的最大长度
+ * @return {int} 返回接收到的个数，返回 0 表示等待时当前协程被杀死
+ */
+int acl_fiber_chan_recv_batch(ACL_FIBER_CHAN* chan, void** ptrs, int max);
+
+/**
+ * 获得管道中当前缓存的对象个数，在多线程环境中仅为参考值
+ * @param chan {ACL_FIBER_CHAN*}
+ * @return {size_t}
+ */
+size_t acl_fiber_chan_size(ACL_FIBER_CHAN* chan);
+
 /* master fibers server */
 
 /**
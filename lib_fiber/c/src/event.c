@@ -8,6 +8,7 @@
 #include <errno.h>
 
 #include "event_epoll.h"
+#include "event_io_uring.h"
 #include "event.h"
 
 //#define DEBUG
@@ -18,10 +19,21 @@
 # define ASSERT (void)
 #endif
 
-EVENT *event_create(int size)
+EVENT *event_create(int size, unsigned flag)
 {
 	int i;
-	EVENT *ev   = event_epoll_create(size);
+	EVENT *ev = NULL;
+
+#ifdef	HAS_IO_URING
+	if (flag & EVENT_F_IO_URING)
+		ev = event_io_uring_create(size);
+#else
+	(void) flag;
+#endif
+
+	/* use epoll if io_uring isn't supported by the kernel */
+	if (ev == NULL)
+		ev = event_epoll_create(size);
 
 	ev->events   = (FILE_EVENT *) acl_mycalloc(size, sizeof(FILE_EVENT));
 	ev->r_defers = (DEFER_DELETE *) acl_mycalloc(size, sizeof(FILE_EVENT));
@@ -86,7 +98,7 @@ static int check_fdtype(int fd)
 	if (fstat(fd, &s) < 0) {
 		acl_msg_info("%s(%d), %s: fd: %d fstat error %s", __FILE__,
 			__LINE__, __FUNCTION__, fd, acl_last_serror());
-		return -1;
+		return TYPE_NOSOCK;
 	}
 
 #if 0
@@ -109,10 +121,46 @@ static int check_fdtype(int fd)
 #endif
 
 	if (S_ISSOCK(s.st_mode) || S_ISFIFO(s.st_mode))
-		return 0;
+		return TYPE_SOCK;
 	if (S_ISCHR(s.st_mode) && isatty(fd))
+		return TYPE_SOCK;
+	if (S_ISREG(s.st_mode) || S_ISBLK(s.st_mode))
+		return TYPE_FILE;
+	return TYPE_NOSOCK;
+}
+
+#define	NOT_POLLED(fe)	((fe)->type == TYPE_NOSOCK || (fe)->type == TYPE_FILE)
+
+/* check if the fd can be polled, the result is cached until it's closed */
+int event_checkfd(EVENT *ev, int fd)
+{
+	FILE_EVENT *fe;
+
+	if (fd < 0 || fd >= ev->setsize)
 		return 0;
-	return -1;
+
+	fe = &ev->events[fd];
+	if (fe->type == TYPE_NONE)
+		fe->type = check_fdtype(fd);
+
+	return fe->type == TYPE_SOCK;
+}
+
+/* check if the fd is a regular file, which is never ready to be polled but
+ * its IO may block the thread for the disk.
+ */
+int event_isfile(EVENT *ev, int fd)
+{
+	FILE_EVENT *fe;
+
+	if (fd < 0 || fd >= ev->setsize)
+		return 0;
+
+	fe = &ev->events[fd];
+	if (fe->type == TYPE_NONE)
+		fe->type = check_fdtype(fd);
+
+	return fe->type == TYPE_FILE;
 }
 
 #define DEL_DELAY
@@ -207,16 +255,13 @@ int event_add(EVENT *ev, int fd, int mask, event_proc *proc, void *ctx)
 
 	fe = &ev->events[fd];
 
-	if (fe->type == TYPE_NOSOCK)
+	if (NOT_POLLED(fe))
 		return 0;
 	else if (fe->type == TYPE_NONE) {
-		if (check_fdtype(fd) == 0)
-			fe->type = TYPE_SOCK;
-		else {
-			fe->type = TYPE_NOSOCK;
-			// return 0;
-			// call epoll_ctl by ev->add to try ADD this fd
-		}
+		fe->type = check_fdtype(fd);
+		if (fe->type == TYPE_FILE)
+			return 0;
+		/* call epoll_ctl by ev->add to try ADD the TYPE_NOSOCK fd */
 	}
 
 #ifdef	DEL_DELAY
@@ -280,6 +325,7 @@ static void __event_del(EVENT *ev, int fd, int mask)
 
 	if (fe->mask == EVENT_NONE) {
 		fe->mask_fired = EVENT_NONE;
+		fe->type       = TYPE_NONE;
 		fe->r_defer    = NULL;
 		fe->w_defer    = NULL;
 		fe->pe         = NULL;
@@ -394,7 +440,7 @@ static void event_defer_w_add(EVENT *ev, int fd)
 
 void event_del(EVENT *ev, int fd, int mask)
 {
-	if (ev->events[fd].type == TYPE_NOSOCK)
+	if (NOT_POLLED(&ev->events[fd]))
 		ev->events[fd].type = TYPE_NONE;
 	else if ((mask & EVENT_ERROR) != 0)
 		event_error_del(ev, fd);
@@ -417,7 +463,7 @@ void event_del(EVENT *ev, int fd, int mask)
 
 void event_del_nodelay(EVENT *ev, int fd, int mask)
 {
-	if (ev->events[fd].type == TYPE_NOSOCK)
+	if (NOT_POLLED(&ev->events[fd]))
 		ev->events[fd].type = TYPE_NONE;
 	else
 		__event_del(ev, fd, mask);
@@ -444,7 +490,7 @@ int event_process(EVENT *ev, int timeout)
 	/* limit the event wait time just for fiber schedule exiting
 	 * quickly when no tasks left
 	 */
-	if (timeout > 1000 || timeout <= 0)
+	if (timeout > 1000 || timeout < 0)
 		timeout = 100;
 
 #ifdef	DEL_DELAY
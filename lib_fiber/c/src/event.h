@@ -4,15 +4,28 @@
 #include <sys/epoll.h>
 #include "fiber/lib_fiber.h"
 
+/* HAS_IO_URING is defined when building on Linux with the io_uring header,
+ * but the kernel headers older than 5.11 are too old to be used.
+ */
+#ifdef	HAS_IO_URING
+# include <linux/io_uring.h>
+# ifndef IORING_ENTER_EXT_ARG
+#  undef HAS_IO_URING
+# endif
+#endif
+
 #define	TYPE_NONE	0
 #define	TYPE_SOCK	1
 #define	TYPE_NOSOCK	2
+#define	TYPE_FILE	3	/* the regular file or block device */
 
 #define	EVENT_NONE	0
 #define	EVENT_READABLE	(unsigned) 1 << 0
 #define	EVENT_WRITABLE	(unsigned) 1 << 1
 #define	EVENT_ERROR	(unsigned) 1 << 2
 
+#define	EVENT_F_IO_URING	(1 << 0)
+
 typedef struct FILE_EVENT   FILE_EVENT;
 typedef struct POLL_CTX     POLL_CTX;
 typedef struct POLL_EVENT   POLL_EVENT;
@@ -82,6 +95,7 @@ struct DEFER_DELETE {
 };
 
 struct EVENT {
+	unsigned flag;
 	int   timeout;
 	int   setsize;
 	int   maxfd;
@@ -103,11 +117,13 @@ struct EVENT {
 	void (*free)(EVENT *);
 };
 
-EVENT *event_create(int size);
+EVENT *event_create(int size, unsigned flag);
 const char *event_name(EVENT *ev);
 int  event_handle(EVENT *ev);
 int  event_size(EVENT *ev);
 void event_free(EVENT *ev);
+int  event_checkfd(EVENT *ev, int fd);
+int  event_isfile(EVENT *ev, int fd);
 int  event_add(EVENT *ev, int fd, int mask, event_proc *proc, void *ctx);
 void event_del(EVENT *ev, int fd, int mask);
 void event_del_nodelay(EVENT *ev, int fd, int mask);
@@ -215,6 +215,7 @@ EVENT *event_epoll_create(int setsize)
 	ep->epfd = __sys_epoll_create(1024);
 	acl_assert(ep->epfd >= 0);
 
+	ep->event.flag   = 0;
 	ep->event.name   = epoll_event_name;
 	ep->event.handle = epoll_event_handle;
 	ep->event.loop   = epoll_event_loop;
@@ -0,0 +1,546 @@
+#include "stdafx.h"
+#include "fiber.h"
+#include "event.h"
+#include "event_io_uring.h"
+
+#ifdef	HAS_IO_URING
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define	SQ_ENTRIES	4096
+
+/* the user_data of the POLL_ADD sqe, which holds the fd and its generation
+ * so the stale completions of the removed polls can be ignored; the lowest
+ * bit is used to tell it from the pointer of IO_URING_REQ.
+ */
+#define	POLL_DATA(fd, gen)	\
+	(((acl_uint64) (gen) << 32) | ((acl_uint64) (fd) << 1) | 1)
+#define	POLL_FD(data)		((int) (((data) & 0xffffffff) >> 1))
+#define	POLL_GEN(data)		((unsigned) ((data) >> 32))
+
+typedef struct EVENT_URING {
+	EVENT    event;
+	int      ring_fd;
+
+	unsigned  sq_mask;
+	unsigned  sq_entries;
+	unsigned  sq_tail;	/* the local tail, published when entering */
+	unsigned *sq_khead;
+	unsigned *sq_ktail;
+	struct io_uring_sqe *sqes;
+
+	unsigned  cq_mask;
+	unsigned *cq_khead;
+	unsigned *cq_ktail;
+	struct io_uring_cqe *cqes;
+
+	void    *sq_ring;
+	size_t   sq_ring_size;
+	void    *cq_ring;
+	size_t   cq_ring_size;
+	size_t   sqes_size;
+
+	unsigned char  *pmask;	/* the poll mask armed in kernel of each fd */
+	unsigned       *pgen;	/* the generation of each fd's poll */
+	unsigned       *nreq;	/* the pending requests of each fd */
+	int            *rearm;	/* the fired fds which may need polling again */
+	int             nrearm;
+
+	IO_URING_REQ *reqs;	/* the free requests for reusing */
+} EVENT_URING;
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(EVENT_URING *eu, unsigned min_complete, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = 0, to_submit;
+	void *argp = NULL;
+	size_t argsz = 0;
+	int ret;
+
+	/* publish the sqes filled by the fibers, which will be submitted
+	 * all together in one syscall
+	 */
+	__atomic_store_n(eu->sq_ktail, eu->sq_tail, __ATOMIC_RELEASE);
+	to_submit = eu->sq_tail - __atomic_load_n(eu->sq_khead,
+			__ATOMIC_ACQUIRE);
+
+	if (min_complete > 0) {
+		flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		ts.tv_sec     = timeout / 1000;
+		ts.tv_nsec    = (timeout % 1000) * 1000000;
+		arg.sigmask   = 0;
+		arg.sigmask_sz = _NSIG / 8;
+		arg.pad       = 0;
+		arg.ts        = (acl_uint64) (unsigned long) &ts;
+		argp          = &arg;
+		argsz         = sizeof(arg);
+	} else if (to_submit == 0)
+		return 0;
+
+	ret = (int) syscall(__NR_io_uring_enter, eu->ring_fd, to_submit,
+			min_complete, flags, argp, argsz);
+	if (ret >= 0)
+		return ret;
+
+	fiber_save_errno();
+
+	if (errno == ETIME || errno == EINTR || errno == EAGAIN
+		|| errno == EBUSY) {
+
+		return 0;
+	}
+
+	acl_msg_error("%s(%d), %s: io_uring_enter error %s", __FILE__,
+		__LINE__, __FUNCTION__, acl_last_serror());
+	return -1;
+}
+
+static struct io_uring_sqe *uring_sqe(EVENT_URING *eu)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head = __atomic_load_n(eu->sq_khead, __ATOMIC_ACQUIRE);
+
+	if (eu->sq_tail - head >= eu->sq_entries) {
+		/* the submission queue is full, submit them now */
+		if (uring_enter(eu, 0, 0) < 0)
+			return NULL;
+
+		head = __atomic_load_n(eu->sq_khead, __ATOMIC_ACQUIRE);
+		if (eu->sq_tail - head >= eu->sq_entries) {
+			acl_msg_error("%s(%d), %s: io_uring sq full",
+				__FILE__, __LINE__, __FUNCTION__);
+			return NULL;
+		}
+	}
+
+	sqe = &eu->sqes[eu->sq_tail & eu->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	eu->sq_tail++;
+	return sqe;
+}
+
+static int uring_poll_add(EVENT_URING *eu, int fd, int mask)
+{
+	struct io_uring_sqe *sqe = uring_sqe(eu);
+
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode    = IORING_OP_POLL_ADD;
+	sqe->fd        = fd;
+	sqe->user_data = POLL_DATA(fd, ++eu->pgen[fd]);
+
+	/* poll_events is in the low 16 bits of poll32_events on any byte
+	 * order as the kernel expecting
+	 */
+	if (mask & EVENT_READABLE)
+		sqe->poll_events |= POLLIN;
+	if (mask & EVENT_WRITABLE)
+		sqe->poll_events |= POLLOUT;
+
+	eu->pmask[fd] = (unsigned char) mask;
+	return 0;
+}
+
+static int uring_poll_remove(EVENT_URING *eu, int fd)
+{
+	struct io_uring_sqe *sqe = uring_sqe(eu);
+
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode    = IORING_OP_POLL_REMOVE;
+	sqe->fd        = -1;
+	sqe->addr      = POLL_DATA(fd, eu->pgen[fd]);
+	sqe->user_data = 0;
+
+	/* the completion of the removed poll will be ignored */
+	eu->pgen[fd]++;
+	eu->pmask[fd] = EVENT_NONE;
+	return 0;
+}
+
+static int uring_event_add(EVENT *ev, int fd, int mask)
+{
+	EVENT_URING *eu = (EVENT_URING *) ev;
+
+	/* the regular files can't be polled */
+	if (ev->events[fd].type == TYPE_NOSOCK) {
+		errno = EPERM;
+		return -1;
+	}
+
+	mask |= ev->events[fd].mask;
+	if ((eu->pmask[fd] & mask) == mask)
+		return 0;
+
+	if (eu->pmask[fd] != EVENT_NONE && uring_poll_remove(eu, fd) < 0)
+		return -1;
+
+	return uring_poll_add(eu, fd, mask);
+}
+
+static int uring_event_del(EVENT *ev, int fd, int delmask)
+{
+	EVENT_URING *eu = (EVENT_URING *) ev;
+	int mask = ev->events[fd].mask & (~delmask);
+
+	if (eu->pmask[fd] & ~mask) {
+		if (uring_poll_remove(eu, fd) < 0)
+			return -1;
+		if (mask != EVENT_NONE && uring_poll_add(eu, fd, mask) < 0)
+			return -1;
+	}
+
+	return mask == EVENT_NONE ? 1 : 0;
+}
+
+static int uring_poll_fired(EVENT_URING *eu, struct io_uring_cqe *cqe)
+{
+	EVENT *ev = &eu->event;
+	int fd = POLL_FD(cqe->user_data), mask = 0;
+
+	if (fd >= ev->setsize || eu->pmask[fd] == EVENT_NONE
+		|| eu->pgen[fd] != POLL_GEN(cqe->user_data)) {
+
+		return 0;
+	}
+
+	eu->pmask[fd] = EVENT_NONE;
+
+	if (cqe->res < 0 || (cqe->res & (POLLERR | POLLHUP | POLLNVAL)))
+		mask = ev->events[fd].mask;
+	else {
+		if (cqe->res & POLLIN)
+			mask |= EVENT_READABLE;
+		if (cqe->res & POLLOUT)
+			mask |= EVENT_WRITABLE;
+	}
+
+	/* the poll is oneshot, it will be armed again in the next loop if
+	 * the fd is still being waited for
+	 */
+	eu->rearm[eu->nrearm++] = fd;
+	return mask;
+}
+
+static void uring_req_done(EVENT_URING *eu, IO_URING_REQ *req, int res)
+{
+	eu->nreq[req->fd]--;
+
+	if (req->status == URING_ORPHAN) {
+		event_uring_free(&eu->event, req);
+		return;
+	}
+
+	req->res    = res;
+	req->status = URING_DONE;
+	req->proc(&eu->event, req);
+}
+
+static int uring_event_loop(EVENT *ev, int timeout)
+{
+	EVENT_URING *eu = (EVENT_URING *) ev;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	int i, fd, mask, nfired = 0;
+
+	for (i = 0; i < eu->nrearm; i++) {
+		fd = eu->rearm[i];
+		if (eu->pmask[fd] == EVENT_NONE
+			&& ev->events[fd].mask != EVENT_NONE) {
+
+			(void) uring_poll_add(eu, fd, ev->events[fd].mask);
+		}
+	}
+	eu->nrearm = 0;
+
+	head = *eu->cq_khead;
+	tail = __atomic_load_n(eu->cq_ktail, __ATOMIC_ACQUIRE);
+
+	/* submit all the sqes and wait for the completions in one syscall */
+	if (uring_enter(eu, head == tail && timeout != 0 ? 1 : 0,
+		timeout) < 0) {
+
+		return -1;
+	}
+
+	tail = __atomic_load_n(eu->cq_ktail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		cqe = &eu->cqes[head & eu->cq_mask];
+
+		if (cqe->user_data == 0)
+			continue;
+
+		if (cqe->user_data & 1) {
+			fd = POLL_FD(cqe->user_data);
+			mask = uring_poll_fired(eu, cqe);
+			if (mask != 0) {
+				ev->fired[nfired].fd   = fd;
+				ev->fired[nfired].mask = mask;
+				nfired++;
+			}
+		} else {
+			uring_req_done(eu, (IO_URING_REQ *) (unsigned long)
+				cqe->user_data, cqe->res);
+		}
+	}
+
+	__atomic_store_n(eu->cq_khead, head, __ATOMIC_RELEASE);
+	return nfired;
+}
+
+IO_URING_REQ *event_uring_req(EVENT *ev, int opcode, int fd)
+{
+	EVENT_URING *eu = (EVENT_URING *) ev;
+	struct io_uring_sqe *sqe = uring_sqe(eu);
+	IO_URING_REQ *req;
+
+	if (sqe == NULL) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	if (eu->reqs != NULL) {
+		req = eu->reqs;
+		eu->reqs = req->next;
+	} else
+		req = (IO_URING_REQ *) acl_mymalloc(sizeof(IO_URING_REQ));
+
+	req->next      = NULL;
+	req->fiber     = NULL;
+	req->proc      = NULL;
+	req->sqe       = sqe;
+	req->fd        = fd;
+	req->res       = 0;
+	req->status    = URING_PENDING;
+
+	sqe->opcode    = (unsigned char) opcode;
+	sqe->fd        = fd;
+	sqe->user_data = (acl_uint64) (unsigned long) req;
+
+	eu->nreq[fd]++;
+	return req;
+}
+
+void event_uring_free(EVENT *ev, IO_URING_REQ *req)
+{
+	EVENT_URING *eu = (EVENT_URING *) ev;
+
+	req->next = eu->reqs;
+	eu->reqs  = req;
+}
+
+void event_uring_cancel(EVENT *ev, IO_URING_REQ *req)
+{
+	EVENT_URING *eu = (EVENT_URING *) ev;
+	struct io_uring_sqe *sqe;
+
+	/* the request will be freed when its completion arrives */
+	req->status = URING_ORPHAN;
+
+	if ((sqe = uring_sqe(eu)) == NULL)
+		return;
+
+	sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+	sqe->fd        = -1;
+	sqe->addr      = (acl_uint64) (unsigned long) req;
+	sqe->user_data = 0;
+}
+
+void event_uring_close(EVENT *ev, int fd)
+{
+	EVENT_URING *eu = (EVENT_URING *) ev;
+
+	if (fd >= ev->setsize)
+		return;
+
+#if defined(IORING_ASYNC_CANCEL_FD) && defined(IORING_ASYNC_CANCEL_ALL)
+	/* the pending requests hold the file in kernel, cancel them so
+	 * the fd can be closed really
+	 */
+	if (eu->nreq[fd] > 0) {
+		struct io_uring_sqe *sqe = uring_sqe(eu);
+
+		if (sqe != NULL) {
+			sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+			sqe->fd           = fd;
+			sqe->cancel_flags = IORING_ASYNC_CANCEL_FD
+				| IORING_ASYNC_CANCEL_ALL;
+			sqe->user_data    = 0;
+		}
+	}
+#endif
+
+	/* the polls removed by event_del and the cancels above must be
+	 * submitted before the fd being closed
+	 */
+	if (eu->sq_tail != *eu->sq_ktail)
+		(void) uring_enter(eu, 0, 0);
+}
+
+static void uring_event_free(EVENT *ev)
+{
+	EVENT_URING *eu = (EVENT_URING *) ev;
+	IO_URING_REQ *req;
+
+	while ((req = eu->reqs) != NULL) {
+		eu->reqs = req->next;
+		acl_myfree(req);
+	}
+
+	munmap(eu->sqes, eu->sqes_size);
+	if (eu->cq_ring != eu->sq_ring)
+		munmap(eu->cq_ring, eu->cq_ring_size);
+	munmap(eu->sq_ring, eu->sq_ring_size);
+	close(eu->ring_fd);
+
+	acl_myfree(eu->pmask);
+	acl_myfree(eu->pgen);
+	acl_myfree(eu->nreq);
+	acl_myfree(eu->rearm);
+	acl_myfree(eu);
+}
+
+static int uring_event_handle(EVENT *ev)
+{
+	EVENT_URING *eu = (EVENT_URING *) ev;
+
+	return eu->ring_fd;
+}
+
+static const char *uring_event_name(void)
+{
+	return "io_uring";
+}
+
+static int uring_mmap(EVENT_URING *eu, struct io_uring_params *p)
+{
+	unsigned *array, i;
+
+	eu->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	eu->cq_ring_size = p->cq_off.cqes
+		+ p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (eu->cq_ring_size > eu->sq_ring_size)
+			eu->sq_ring_size = eu->cq_ring_size;
+		eu->cq_ring_size = eu->sq_ring_size;
+	}
+
+	eu->sq_ring = mmap(NULL, eu->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, eu->ring_fd, IORING_OFF_SQ_RING);
+	if (eu->sq_ring == MAP_FAILED)
+		return -1;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		eu->cq_ring = eu->sq_ring;
+	else {
+		eu->cq_ring = mmap(NULL, eu->cq_ring_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			eu->ring_fd, IORING_OFF_CQ_RING);
+		if (eu->cq_ring == MAP_FAILED) {
+			munmap(eu->sq_ring, eu->sq_ring_size);
+			return -1;
+		}
+	}
+
+	eu->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	eu->sqes = (struct io_uring_sqe *) mmap(NULL, eu->sqes_size,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		eu->ring_fd, IORING_OFF_SQES);
+	if (eu->sqes == MAP_FAILED) {
+		if (eu->cq_ring != eu->sq_ring)
+			munmap(eu->cq_ring, eu->cq_ring_size);
+		munmap(eu->sq_ring, eu->sq_ring_size);
+		return -1;
+	}
+
+#define	SQ_PTR(off)	((unsigned *) ((char *) eu->sq_ring + (off)))
+#define	CQ_PTR(off)	((unsigned *) ((char *) eu->cq_ring + (off)))
+
+	eu->sq_khead   = SQ_PTR(p->sq_off.head);
+	eu->sq_ktail   = SQ_PTR(p->sq_off.tail);
+	eu->sq_mask    = *SQ_PTR(p->sq_off.ring_mask);
+	eu->sq_entries = p->sq_entries;
+	eu->sq_tail    = *eu->sq_ktail;
+
+	eu->cq_khead   = CQ_PTR(p->cq_off.head);
+	eu->cq_ktail   = CQ_PTR(p->cq_off.tail);
+	eu->cq_mask    = *CQ_PTR(p->cq_off.ring_mask);
+	eu->cqes       = (struct io_uring_cqe *)
+		((char *) eu->cq_ring + p->cq_off.cqes);
+
+	/* the sqes are always used in order, so map them one by one */
+	array = SQ_PTR(p->sq_off.array);
+	for (i = 0; i < p->sq_entries; i++)
+		array[i] = i;
+
+	return 0;
+}
+
+EVENT *event_io_uring_create(int setsize)
+{
+	EVENT_URING *eu;
+	struct io_uring_params params;
+	unsigned features = IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL
+		| IORING_FEAT_EXT_ARG;
+	int fd;
+
+	memset(&params, 0, sizeof(params));
+
+	/* fails on the old kernels or when io_uring was disabled */
+	fd = uring_setup(SQ_ENTRIES, &params);
+	if (fd < 0) {
+		fiber_save_errno();
+		acl_msg_warn("%s(%d), %s: io_uring_setup error %s",
+			__FILE__, __LINE__, __FUNCTION__, acl_last_serror());
+		return NULL;
+	}
+
+	if ((params.features & features) != features) {
+		acl_msg_warn("%s(%d), %s: io_uring features 0x%x not enough",
+			__FILE__, __LINE__, __FUNCTION__, params.features);
+		close(fd);
+		return NULL;
+	}
+
+	eu = (EVENT_URING *) acl_mycalloc(1, sizeof(EVENT_URING));
+	eu->ring_fd = fd;
+
+	if (uring_mmap(eu, &params) < 0) {
+		fiber_save_errno();
+		acl_msg_warn("%s(%d), %s: mmap io_uring error %s",
+			__FILE__, __LINE__, __FUNCTION__, acl_last_serror());
+		close(fd);
+		acl_myfree(eu);
+		return NULL;
+	}
+
+	eu->pmask = (unsigned char *) acl_mycalloc(setsize, sizeof(char));
+	eu->pgen  = (unsigned *) acl_mycalloc(setsize, sizeof(unsigned));
+	eu->nreq  = (unsigned *) acl_mycalloc(setsize, sizeof(unsigned));
+	eu->rearm = (int *) acl_mycalloc(setsize, sizeof(int));
+	eu->reqs  = NULL;
+
+	eu->event.flag   = EVENT_F_IO_URING;
+	eu->event.name   = uring_event_name;
+	eu->event.handle = uring_event_handle;
+	eu->event.loop   = uring_event_loop;
+	eu->event.add    = uring_event_add;
+	eu->event.del    = uring_event_del;
+	eu->event.free   = uring_event_free;
+
+	return (EVENT *) eu;
+}
+
+#endif /* HAS_IO_URING */
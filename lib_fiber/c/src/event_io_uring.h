@@ -0,0 +1,36 @@
+#ifndef EVENT_IO_URING_INCLUDE_H
+#define EVENT_IO_URING_INCLUDE_H
+
+#include "event.h"
+
+#ifdef	HAS_IO_URING
+
+#include <linux/io_uring.h>
+
+#define	URING_PENDING	0
+#define	URING_DONE	1
+#define	URING_ORPHAN	2
+
+typedef struct IO_URING_REQ IO_URING_REQ;
+typedef void uring_proc(EVENT *ev, IO_URING_REQ *req);
+
+/* one completion based IO operation submitted by a fiber */
+struct IO_URING_REQ {
+	IO_URING_REQ *next;
+	ACL_FIBER    *fiber;
+	uring_proc   *proc;
+	struct io_uring_sqe *sqe;  /* valid only before the next submitting */
+	int fd;
+	int res;
+	int status;
+};
+
+EVENT *event_io_uring_create(int setsize);
+IO_URING_REQ *event_uring_req(EVENT *ev, int opcode, int fd);
+void event_uring_free(EVENT *ev, IO_URING_REQ *req);
+void event_uring_cancel(EVENT *ev, IO_URING_REQ *req);
+void event_uring_close(EVENT *ev, int fd);
+
+#endif /* HAS_IO_URING */
+
+#endif
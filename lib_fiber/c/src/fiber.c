@@ -32,20 +32,53 @@ typedef struct {
 	int            count;
 	int            switched;
 	int            nlocal;
+	unsigned long long nswitch;	/* the total times of switching */
+	long long      begin;		/* when the running one was switched to */
+
+	/* for the M:N scheduling */
+	int            mn;		/* running in a fiber group */
+	int            index;		/* the thread's index in the group */
+	int            victim;		/* the next thread to steal from */
+	volatile int   lock;		/* protecting ready from stealing */
+	ACL_FIBER     *defer;		/* to be ready after switching */
+	int            defer_head;
+
+	/* for the fibers using the shared stack */
+	char          *share;		/* the shared stack of the thread */
+	size_t         share_size;
+	ACL_FIBER     *occupy;		/* whose stack is on the shared one */
 } FIBER_TLS;
 
+/* the threads scheduling the fibers together in M:N mode; a fiber may be
+ * stolen by another thread when it's ready, so the running fiber must not
+ * put itself into the ready queue until its context has been saved.
+ */
+typedef struct {
+	FIBER_TLS    **threads;
+	int            nthreads;
+	int            nrunning;
+	int            nfibers;		/* the user fibers alive */
+	int            nlocal;
+	unsigned       idgen;
+	acl_pthread_mutex_t lock;
+	acl_pthread_cond_t  cond;
+} FIBER_GROUP;
+
 static void fiber_init(void) __attribute__ ((constructor));
 
+static FIBER_GROUP *__group = NULL;
+static size_t __shared_stack_size = 1024000;
 static FIBER_TLS *__main_fiber = NULL;
 static __thread FIBER_TLS *__thread_fiber = NULL;
 static __thread int __scheduled = 0;
 __thread int acl_var_hook_sys_api = 0;
+int fiber_profile_on = 0;
 
 static acl_pthread_key_t __fiber_key;
 
 /* forward declare */
 static ACL_FIBER *fiber_alloc(void (*fn)(ACL_FIBER *, void *),
-	void *arg, size_t size);
+	void *arg, size_t size, unsigned share);
 
 void acl_fiber_hook_api(int onoff)
 {
@@ -68,6 +101,8 @@ static void thread_free(void *ctx)
 		acl_myfree(tf->fibers);
 	if (tf->original.context)
 		acl_myfree(tf->original.context);
+	if (tf->share)
+		fiber_stack_free(tf->share, tf->share_size);
 	acl_myfree(tf);
 
 	if (__main_fiber == __thread_fiber)
@@ -104,7 +139,7 @@ static void fiber_check(void)
 			__FILE__, __LINE__, __FUNCTION__, acl_last_serror());
 
 	__thread_fiber = (FIBER_TLS *) acl_mycalloc(1, sizeof(FIBER_TLS));
-#ifdef	USE_JMP
+#if	defined(USE_JMP) || defined(USE_ASM_CTX)
 	/* set context NULL when using setjmp that setcontext will not be
 	 * called in fiber_swap.
 	 */
@@ -331,6 +366,352 @@ void fiber_save_errno(void)
     siglongjmp(ctx, 1)
 #endif
 
+#ifdef	USE_ASM_CTX
+
+/* save the callee-saved registers on the current stack, store the stack
+ * pointer in *from and restore the registers from the stack of to.
+ */
+void fiber_ctx_swap(void **from, void *to)
+	__attribute__ ((visibility("hidden")));
+
+/* the first function running on a new fiber's stack, which calls the fiber
+ * function with the fiber, both of them were put in the fiber's stack by
+ * fiber_ctx_make.
+ */
+void fiber_ctx_entry(void) __attribute__ ((visibility("hidden")));
+
+# if defined(__x86_64__)
+
+__asm__ (
+	".text\n"
+	".globl  fiber_ctx_swap\n"
+	".hidden fiber_ctx_swap\n"
+	".type   fiber_ctx_swap, @function\n"
+	".align  16\n"
+	"fiber_ctx_swap:\n"
+	"	pushq   %rbp\n"
+	"	pushq   %rbx\n"
+	"	pushq   %r12\n"
+	"	pushq   %r13\n"
+	"	pushq   %r14\n"
+	"	pushq   %r15\n"
+	"	subq    $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw  4(%rsp)\n"
+	"	movq    %rsp, (%rdi)\n"
+	"	movq    %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw   4(%rsp)\n"
+	"	addq    $8, %rsp\n"
+	"	popq    %r15\n"
+	"	popq    %r14\n"
+	"	popq    %r13\n"
+	"	popq    %r12\n"
+	"	popq    %rbx\n"
+	"	popq    %rbp\n"
+	"	ret\n"
+	".size   fiber_ctx_swap, .-fiber_ctx_swap\n"
+
+	".globl  fiber_ctx_entry\n"
+	".hidden fiber_ctx_entry\n"
+	".type   fiber_ctx_entry, @function\n"
+	".align  16\n"
+	"fiber_ctx_entry:\n"
+	"	movq    %r12, %rdi\n"
+	"	callq   *%r13\n"
+	"	ud2\n"
+	".size   fiber_ctx_entry, .-fiber_ctx_entry\n"
+);
+
+/* the stack frame saved by fiber_ctx_swap, from the lower address */
+#  define CTX_FRAME_SIZE	10
+#  define CTX_CSR		0
+#  define CTX_ARG		4	/* r12 */
+#  define CTX_FN		3	/* r13 */
+#  define CTX_RET		7
+
+# elif defined(__aarch64__)
+
+__asm__ (
+	".text\n"
+	".globl  fiber_ctx_swap\n"
+	".hidden fiber_ctx_swap\n"
+	".type   fiber_ctx_swap, %function\n"
+	".align  4\n"
+	"fiber_ctx_swap:\n"
+	"	sub     sp, sp, #160\n"
+	"	stp     x19, x20, [sp, #0]\n"
+	"	stp     x21, x22, [sp, #16]\n"
+	"	stp     x23, x24, [sp, #32]\n"
+	"	stp     x25, x26, [sp, #48]\n"
+	"	stp     x27, x28, [sp, #64]\n"
+	"	stp     x29, x30, [sp, #80]\n"
+	"	stp     d8,  d9,  [sp, #96]\n"
+	"	stp     d10, d11, [sp, #112]\n"
+	"	stp     d12, d13, [sp, #128]\n"
+	"	stp     d14, d15, [sp, #144]\n"
+	"	mov     x9, sp\n"
+	"	str     x9, [x0]\n"
+	"	mov     sp, x1\n"
+	"	ldp     x19, x20, [sp, #0]\n"
+	"	ldp     x21, x22, [sp, #16]\n"
+	"	ldp     x23, x24, [sp, #32]\n"
+	"	ldp     x25, x26, [sp, #48]\n"
+	"	ldp     x27, x28, [sp, #64]\n"
+	"	ldp     x29, x30, [sp, #80]\n"
+	"	ldp     d8,  d9,  [sp, #96]\n"
+	"	ldp     d10, d11, [sp, #112]\n"
+	"	ldp     d12, d13, [sp, #128]\n"
+	"	ldp     d14, d15, [sp, #144]\n"
+	"	add     sp, sp, #160\n"
+	"	ret\n"
+	".size   fiber_ctx_swap, .-fiber_ctx_swap\n"
+
+	".globl  fiber_ctx_entry\n"
+	".hidden fiber_ctx_entry\n"
+	".type   fiber_ctx_entry, %function\n"
+	".align  4\n"
+	"fiber_ctx_entry:\n"
+	"	mov     x0, x19\n"
+	"	blr     x20\n"
+	"	brk     #0\n"
+	".size   fiber_ctx_entry, .-fiber_ctx_entry\n"
+);
+
+/* the stack frame saved by fiber_ctx_swap, from the lower address */
+#  define CTX_FRAME_SIZE	20
+#  define CTX_ARG		0	/* x19 */
+#  define CTX_FN		1	/* x20 */
+#  define CTX_RET		11	/* x30 */
+
+# endif
+
+static void fiber_run(ACL_FIBER *fiber);
+
+#define	CTX_TOP(p)	((unsigned long *) (((unsigned long) (p)) & ~15UL))
+#define	SHARE_TOP(tf)	CTX_TOP((tf)->share + (tf)->share_size)
+
+/* build the initial stack frame of a new fiber, the first fiber_ctx_swap
+ * to it will "return" to fiber_ctx_entry which then calls fiber_run.
+ */
+static void fiber_ctx_frame(ACL_FIBER *fiber, unsigned long *sp)
+{
+	memset(sp, 0, CTX_FRAME_SIZE * sizeof(unsigned long));
+
+# if defined(__x86_64__)
+	{
+		unsigned int   mxcsr;
+		unsigned short fpucw;
+
+		__asm__ __volatile__ ("stmxcsr %0" : "=m" (mxcsr));
+		__asm__ __volatile__ ("fnstcw %0" : "=m" (fpucw));
+		sp[CTX_CSR] = mxcsr | ((unsigned long) fpucw << 32);
+	}
+# endif
+
+	sp[CTX_ARG] = (unsigned long) fiber;
+	sp[CTX_FN]  = (unsigned long) fiber_run;
+	sp[CTX_RET] = (unsigned long) fiber_ctx_entry;
+}
+
+static void fiber_ctx_make(ACL_FIBER *fiber)
+{
+	FIBER_TLS *tf = __thread_fiber;
+	size_t len = CTX_FRAME_SIZE * sizeof(unsigned long);
+
+	if (!(fiber->flag & FIBER_F_SHARED)) {
+		fiber->sp = CTX_TOP(fiber->buff + fiber->size) - CTX_FRAME_SIZE;
+		fiber_ctx_frame(fiber, (unsigned long *) fiber->sp);
+		return;
+	}
+
+	/* the frame is put in the saved stack, to be copied to the top of
+	 * the shared stack when the fiber runs first time.
+	 */
+	if (fiber->buff == NULL) {
+		fiber->size = 512;
+		fiber->buff = (char *) acl_mymalloc(fiber->size);
+	}
+
+	fiber_ctx_frame(fiber, (unsigned long *) fiber->buff);
+	fiber->used = len;
+	fiber->sp   = SHARE_TOP(tf) - CTX_FRAME_SIZE;
+}
+
+/* The fibers using the shared stack of a thread run on it in turn: the
+ * used part of the stack of the one switched out is saved in its own
+ * buffer only when another one is going to run on the shared stack, and
+ * copied back before it runs again. The copying can't be done on the
+ * shared stack itself, so switching between two of them goes through the
+ * thread's original context; and because their stacks have the addresses
+ * of the thread's shared stack, they're never stolen in M:N mode.
+ */
+static void fiber_stack_save(FIBER_TLS *tf, ACL_FIBER *fiber)
+{
+	size_t used = (char *) SHARE_TOP(tf) - (char *) fiber->sp;
+
+	if (used > fiber->size || fiber->size > used * 4 + 4096) {
+		acl_myfree(fiber->buff);
+		fiber->size = (used + 511) & ~511UL;
+		fiber->buff = (char *) acl_mymalloc(fiber->size);
+	}
+
+	memcpy(fiber->buff, fiber->sp, used);
+	fiber->used = used;
+}
+
+static void fiber_stack_restore(FIBER_TLS *tf, ACL_FIBER *fiber)
+{
+	if (tf->occupy != NULL)
+		fiber_stack_save(tf, tf->occupy);
+
+	memcpy(fiber->sp, fiber->buff, fiber->used);
+	tf->occupy = fiber;
+}
+
+#endif /* USE_ASM_CTX */
+
+/* the thread local variables must be read again after switching, because
+ * the fiber may be resumed in another thread in M:N mode, but the compiler
+ * may reuse their addresses got before switching in the same function.
+ */
+static FIBER_TLS *fiber_tls(void) __attribute__ ((noinline));
+
+static FIBER_TLS *fiber_tls(void)
+{
+	return __thread_fiber;
+}
+
+static void ready_lock(volatile int *lock)
+{
+	while (__sync_lock_test_and_set(lock, 1)) {
+		while (*lock) {}
+	}
+}
+
+#define	ready_unlock(lock)	__sync_lock_release(lock)
+
+/* add the fiber into the tail of the ready queue, or the head if first
+ * isn't 0; the idle threads will be waked up to steal some of them if
+ * there're more than one ready in M:N mode.
+ */
+static void ready_push(FIBER_TLS *tf, ACL_FIBER *fiber, int first)
+{
+	int n;
+
+	if (!tf->mn) {
+		if (first)
+			acl_ring_append(&tf->ready, &fiber->me);
+		else
+			acl_ring_prepend(&tf->ready, &fiber->me);
+		return;
+	}
+
+	ready_lock(&tf->lock);
+	if (first)
+		acl_ring_append(&tf->ready, &fiber->me);
+	else
+		acl_ring_prepend(&tf->ready, &fiber->me);
+	n = acl_ring_size(&tf->ready);
+	ready_unlock(&tf->lock);
+
+	if (n > 1)
+		fiber_io_mn_wakeup();
+}
+
+static ACL_FIBER *ready_pop(FIBER_TLS *tf)
+{
+	ACL_RING *head;
+
+	if (!tf->mn)
+		head = acl_ring_pop_head(&tf->ready);
+	else {
+		ready_lock(&tf->lock);
+		head = acl_ring_pop_head(&tf->ready);
+		ready_unlock(&tf->lock);
+	}
+
+	return head ? ACL_RING_TO_APPL(head, ACL_FIBER, me) : NULL;
+}
+
+/* called in the fiber just resumed, to put the previous fiber which wants
+ * to run again into the ready queue, after its context has been saved.
+ */
+static void fiber_switched(void) __attribute__ ((noinline));
+
+static void fiber_switched(void)
+{
+	FIBER_TLS *tf = __thread_fiber;
+	ACL_FIBER *fiber = tf->defer;
+
+	if (fiber != NULL) {
+		tf->defer = NULL;
+		ready_push(tf, fiber, tf->defer_head);
+	}
+}
+
+#define	FIBER_STEALABLE(f)  \
+	(!(f)->sys && (f)->signum == 0  \
+	 && !((f)->flag & (FIBER_F_PINNED | FIBER_F_SHARED)))
+
+/* steal about half of the ready fibers from one of the other threads, the
+ * fibers being signaled or pinned are left, because they may be waiting
+ * for something belonging to their threads.
+ */
+int fiber_mn_steal(void)
+{
+	FIBER_TLS *tf = __thread_fiber, *victim;
+	ACL_RING stolen, *iter, *next;
+	ACL_FIBER *fiber;
+	int i, max, n = 0;
+
+	if (!tf->mn)
+		return 0;
+
+	acl_ring_init(&stolen);
+
+	for (i = 0; i < __group->nthreads && n == 0; i++) {
+		victim = __group->threads[tf->victim++ % __group->nthreads];
+		if (victim == NULL || victim == tf
+			|| acl_ring_size(&victim->ready) == 0) {
+
+			continue;
+		}
+
+		ready_lock(&victim->lock);
+
+		max = (acl_ring_size(&victim->ready) + 1) / 2;
+		for (iter = victim->ready.succ; iter != &victim->ready
+			&& n < max; iter = next) {
+
+			next  = iter->succ;
+			fiber = ACL_RING_TO_APPL(iter, ACL_FIBER, me);
+			if (FIBER_STEALABLE(fiber)) {
+				acl_ring_detach(iter);
+				acl_ring_prepend(&stolen, iter);
+				n++;
+			}
+		}
+
+		ready_unlock(&victim->lock);
+	}
+
+	if (n > 0) {
+		ready_lock(&tf->lock);
+		while ((iter = acl_ring_pop_head(&stolen)) != NULL)
+			acl_ring_prepend(&tf->ready, iter);
+		ready_unlock(&tf->lock);
+	}
+
+	return n;
+}
+
+static void fiber_mn_exit(void)
+{
+	if (__sync_sub_and_fetch(&__group->nfibers, 1) == 0)
+		fiber_io_mn_stop();
+}
+
 static void fiber_kick(int max)
 {
 	ACL_RING *head;
@@ -346,8 +727,31 @@ static void fiber_kick(int max)
 	}
 }
 
+/* the running time is added to the fiber switched from, including the
+ * original context of the thread for scheduling.
+ */
+static void fiber_account(FIBER_TLS *tf, ACL_FIBER *from, ACL_FIBER *to)
+{
+	long long now;
+
+	to->nswitch++;
+	tf->nswitch++;
+
+	if (!fiber_profile_on) {
+		tf->begin = 0;
+		return;
+	}
+
+	FIBER_NS(now);
+	if (tf->begin > 0)
+		from->run_ns += now - tf->begin;
+	tf->begin = now;
+}
+
 static void fiber_swap(ACL_FIBER *from, ACL_FIBER *to)
 {
+	fiber_account(__thread_fiber, from, to);
+
 	if (from->status == FIBER_STATUS_EXITING) {
 		size_t slot = from->slot;
 		int n = acl_ring_size(&__thread_fiber->dead);
@@ -360,12 +764,24 @@ static void fiber_swap(ACL_FIBER *from, ACL_FIBER *to)
 			fiber_kick(n);
 		}
 
-		if (!from->sys)
+		if (!from->sys) {
 			__thread_fiber->count--;
+			if (__thread_fiber->mn)
+				fiber_mn_exit();
+		}
 
-		__thread_fiber->fibers[slot] =
-			__thread_fiber->fibers[--__thread_fiber->slot];
-		__thread_fiber->fibers[slot]->slot = slot;
+		/* the fibers may exit in other threads in M:N mode */
+		if (slot < __thread_fiber->slot
+			&& __thread_fiber->fibers[slot] == from) {
+
+			__thread_fiber->fibers[slot] =
+				__thread_fiber->fibers[--__thread_fiber->slot];
+			__thread_fiber->fibers[slot]->slot = slot;
+		}
+
+		/* the stack of the fiber exiting needn't be saved */
+		if (__thread_fiber->occupy == from)
+			__thread_fiber->occupy = NULL;
 
 		acl_ring_prepend(&__thread_fiber->dead, &from->me);
 	}
@@ -384,11 +800,19 @@ static void fiber_swap(ACL_FIBER *from, ACL_FIBER *to)
 		else
 			LONGJMP(to->env);
 	}
+#elif	defined(USE_ASM_CTX)
+	if ((to->flag & FIBER_F_SHARED) && __thread_fiber->occupy != to)
+		fiber_stack_restore(__thread_fiber, to);
+
+	fiber_ctx_swap(&from->sp, to->sp);
 #else
 	if (swapcontext(from->context, to->context) < 0)
 		acl_msg_fatal("%s(%d), %s: swapcontext error %s",
 			__FILE__, __LINE__, __FUNCTION__, acl_last_serror());
 #endif
+
+	if (__group != NULL)
+		fiber_switched();
 }
 
 ACL_FIBER *acl_fiber_running(void)
@@ -436,7 +860,13 @@ void acl_fiber_signal(ACL_FIBER *fiber, int signum)
 		return;
 
 	acl_ring_detach(&curr->me);
-	acl_ring_detach(&fiber->me);
+	if (__thread_fiber->mn) {
+		ready_lock(&__thread_fiber->lock);
+		acl_ring_detach(&fiber->me);
+		ready_unlock(&__thread_fiber->lock);
+	} else
+		acl_ring_detach(&fiber->me);
+	fiber_io_timer_del(fiber);
 
 	/* add the current fiber and signed fiber in the head of the ready */
 #if 0
@@ -444,10 +874,14 @@ void acl_fiber_signal(ACL_FIBER *fiber, int signum)
 	acl_fiber_yield();
 #else
 	curr->status = FIBER_STATUS_READY;
-	acl_ring_append(&__thread_fiber->ready, &curr->me);
+	if (__thread_fiber->mn) {
+		__thread_fiber->defer      = curr;
+		__thread_fiber->defer_head = 1;
+	} else
+		acl_ring_append(&__thread_fiber->ready, &curr->me);
 
 	fiber->status = FIBER_STATUS_READY;
-	acl_ring_append(&__thread_fiber->ready, &fiber->me);
+	ready_push(__thread_fiber, fiber, 1);
 
 	acl_fiber_switch();
 #endif
@@ -462,10 +896,13 @@ int acl_fiber_signum(ACL_FIBER *fiber)
 
 void fiber_exit(int exit_code)
 {
+	FIBER_TLS *tf;
+
 	fiber_check();
 
-	__thread_fiber->exitcode = exit_code;
-	__thread_fiber->running->status = FIBER_STATUS_EXITING;
+	tf = fiber_tls();
+	tf->exitcode = exit_code;
+	tf->running->status = FIBER_STATUS_EXITING;
 
 	acl_fiber_switch();
 }
@@ -474,24 +911,61 @@ void acl_fiber_ready(ACL_FIBER *fiber)
 {
 	if (fiber->status != FIBER_STATUS_EXITING) {
 		fiber->status = FIBER_STATUS_READY;
-		acl_ring_prepend(&__thread_fiber->ready, &fiber->me);
+		ready_push(__thread_fiber, fiber, 0);
 	}
 }
 
 int acl_fiber_yield(void)
 {
+	FIBER_TLS *tf = __thread_fiber;
 	int  n;
 
-	if (acl_ring_size(&__thread_fiber->ready) == 0)
+	if (acl_ring_size(&tf->ready) == 0)
 		return 0;
 
-	n = __thread_fiber->switched;
-	acl_fiber_ready(__thread_fiber->running);
+	n = tf->switched;
+	if (tf->mn) {
+		tf->running->status = FIBER_STATUS_READY;
+		tf->defer      = tf->running;
+		tf->defer_head = 0;
+	} else
+		acl_fiber_ready(tf->running);
 	acl_fiber_switch();
 
-	return __thread_fiber->switched - n - 1;
+	/* the fiber may be running in another thread now in M:N mode */
+	if (fiber_tls() != tf)
+		return 0;
+	return tf->switched - n - 1;
 }
 
+static void fiber_run(ACL_FIBER *fiber)
+{
+	int i;
+
+	if (__group != NULL)
+		fiber_switched();
+
+	fiber->fn(fiber, fiber->arg);
+
+	for (i = 0; i < fiber->nlocal; i++) {
+		if (fiber->locals[i] == NULL)
+			continue;
+		if (fiber->locals[i]->free_fn)
+			fiber->locals[i]->free_fn(fiber->locals[i]->ctx);
+		acl_myfree(fiber->locals[i]);
+	}
+
+	if (fiber->locals) {
+		acl_myfree(fiber->locals);
+		fiber->locals = NULL;
+		fiber->nlocal = 0;
+	}
+
+	fiber_exit(0);
+}
+
+#ifndef	USE_ASM_CTX
+
 union cc_arg
 {
 	void *p;
@@ -502,7 +976,6 @@ static void fiber_start(unsigned int x, unsigned int y)
 {
 	union  cc_arg arg;
 	ACL_FIBER *fiber;
-	int i;
 
 	arg.i[0] = x;
 	arg.i[1] = y;
@@ -517,25 +990,11 @@ static void fiber_start(unsigned int x, unsigned int y)
 	}
 #endif
 
-	fiber->fn(fiber, fiber->arg);
-
-	for (i = 0; i < fiber->nlocal; i++) {
-		if (fiber->locals[i] == NULL)
-			continue;
-		if (fiber->locals[i]->free_fn)
-			fiber->locals[i]->free_fn(fiber->locals[i]->ctx);
-		acl_myfree(fiber->locals[i]);
-	}
-
-	if (fiber->locals) {
-		acl_myfree(fiber->locals);
-		fiber->locals = NULL;
-		fiber->nlocal = 0;
-	}
-
-	fiber_exit(0);
+	fiber_run(fiber);
 }
 
+#endif /* !USE_ASM_CTX */
+
 int acl_fiber_ndead(void)
 {
 	if (__thread_fiber == NULL)
@@ -543,23 +1002,43 @@ int acl_fiber_ndead(void)
 	return acl_ring_size(&__thread_fiber->dead);
 }
 
+static void fiber_stack_release(ACL_FIBER *fiber)
+{
+	if (fiber->buff == NULL)
+		return;
+
+	if (fiber->flag & FIBER_F_SHARED)
+		acl_myfree(fiber->buff);
+	else
+		fiber_stack_free(fiber->buff, fiber->size);
+
+	fiber->buff = NULL;
+	fiber->size = 0;
+	fiber->used = 0;
+}
+
 void fiber_free(ACL_FIBER *fiber)
 {
 #ifdef USE_VALGRIND
-	VALGRIND_STACK_DEREGISTER(fiber->vid);
+	if (!(fiber->flag & FIBER_F_SHARED))
+		VALGRIND_STACK_DEREGISTER(fiber->vid);
 #endif
 	if (fiber->context)
 		acl_myfree(fiber->context);
-	acl_myfree(fiber->buff);
+	if (__thread_fiber && __thread_fiber->occupy == fiber)
+		__thread_fiber->occupy = NULL;
+	fiber_stack_release(fiber);
 	acl_myfree(fiber);
 }
 
 static ACL_FIBER *fiber_alloc(void (*fn)(ACL_FIBER *, void *),
-	void *arg, size_t size)
+	void *arg, size_t size, unsigned share)
 {
 	ACL_FIBER *fiber;
+#ifndef	USE_ASM_CTX
 	sigset_t zero;
 	union cc_arg carg;
+#endif
 	ACL_RING *head;
 
 	fiber_check();
@@ -568,34 +1047,62 @@ static ACL_FIBER *fiber_alloc(void (*fn)(ACL_FIBER *, void *),
 
 	/* try to reuse the fiber memory in dead queue */
 	head = acl_ring_pop_head(&__thread_fiber->dead);
-	if (head == NULL) {
+	if (head == NULL)
 		fiber = (ACL_FIBER *) acl_mycalloc(1, sizeof(ACL_FIBER));
-		/* no using calloc just avoiding using real memory */
-		fiber->buff = (char *) acl_mymalloc(size);
-	} else if ((fiber = APPL(head, ACL_FIBER, me))->size < size) {
-		/* if using realloc, real memory will be used, when we first
-		 * free and malloc again, then we'll just use virtual memory,
-		 * because memcpy will be called in realloc.
-		 */
-		/* fiber->buff = (char *) acl_myrealloc(fiber->buff, size); */
-		acl_myfree(fiber->buff);
-		fiber->buff = (char *) acl_mymalloc(size);
-	} else
-		size = fiber->size;
+	else {
+		fiber = APPL(head, ACL_FIBER, me);
+		if ((fiber->flag & FIBER_F_SHARED) != share
+			|| (!share && fiber->size < size)) {
+
+			fiber_stack_release(fiber);
+		}
+	}
+
+	if (share) {
+		if (__thread_fiber->share == NULL) {
+			__thread_fiber->share_size = __shared_stack_size;
+			__thread_fiber->share = fiber_stack_alloc(
+				&__thread_fiber->share_size);
+		}
+	} else if (fiber->buff == NULL) {
+		fiber->buff = fiber_stack_alloc(&size);
+		fiber->size = size;
+	}
 
-	__thread_fiber->idgen++;
-	if (__thread_fiber->idgen == 0)  /* overflow ? */
+	if (__thread_fiber->mn) {
+		fiber->id = __sync_add_and_fetch(&__group->idgen, 1);
+		if (fiber->id == 0)  /* overflow ? */
+			fiber->id = __sync_add_and_fetch(&__group->idgen, 1);
+	} else {
 		__thread_fiber->idgen++;
+		if (__thread_fiber->idgen == 0)  /* overflow ? */
+			__thread_fiber->idgen++;
+
+		fiber->id = __thread_fiber->idgen;
+	}
 
-	fiber->id     = __thread_fiber->idgen;
 	fiber->errnum = 0;
 	fiber->signum = 0;
+	fiber->nswitch     = 0;
+	fiber->nwait_io    = 0;
+	fiber->nwait_timer = 0;
+	fiber->run_ns      = 0;
+	fiber->io_ns       = 0;
+	fiber->timer_ns    = 0;
 	fiber->fn     = fn;
 	fiber->arg    = arg;
-	fiber->size   = size;
-	fiber->flag   = 0;
+	fiber->flag   = share;
 	fiber->status = FIBER_STATUS_READY;
 
+#ifdef	USE_ASM_CTX
+	fiber_ctx_make(fiber);
+
+# ifdef USE_VALGRIND
+	if (!share)
+		fiber->vid = VALGRIND_STACK_REGISTER(fiber->buff,
+				fiber->buff + fiber->size);
+# endif
+#else
 	carg.p = fiber;
 
 	if (fiber->context == NULL)
@@ -624,17 +1131,24 @@ static ACL_FIBER *fiber_alloc(void (*fn)(ACL_FIBER *, void *),
 #endif
 	makecontext(fiber->context, (void(*)(void)) fiber_start,
 		2, carg.i[0], carg.i[1]);
+#endif /* USE_ASM_CTX */
 
 	return fiber;
 }
 
-ACL_FIBER *acl_fiber_create(void (*fn)(ACL_FIBER *, void *),
-	void *arg, size_t size)
+static ACL_FIBER *fiber_create(void (*fn)(ACL_FIBER *, void *),
+	void *arg, size_t size, unsigned share)
 {
-	ACL_FIBER *fiber = fiber_alloc(fn, arg, size);
+	ACL_FIBER *fiber = fiber_alloc(fn, arg, size, share);
 
 	__thread_fiber->count++;
 
+	if (__thread_fiber->mn) {
+		__sync_add_and_fetch(&__group->nfibers, 1);
+		acl_fiber_ready(fiber);
+		return fiber;
+	}
+
 	if (__thread_fiber->slot >= __thread_fiber->size) {
 		__thread_fiber->size += 128;
 		__thread_fiber->fibers = (ACL_FIBER **) acl_myrealloc(
@@ -650,6 +1164,42 @@ ACL_FIBER *acl_fiber_create(void (*fn)(ACL_FIBER *, void *),
 	return fiber;
 }
 
+ACL_FIBER *acl_fiber_create(void (*fn)(ACL_FIBER *, void *),
+	void *arg, size_t size)
+{
+	return fiber_create(fn, arg, size, 0);
+}
+
+void acl_fiber_set_shared_stack_size(size_t size)
+{
+	if (size > 0)
+		__shared_stack_size = size;
+}
+
+size_t acl_fiber_get_shared_stack_size(void)
+{
+	return __shared_stack_size;
+}
+
+ACL_FIBER *acl_fiber_create_shared(void (*fn)(ACL_FIBER *, void *),
+	void *arg)
+{
+#ifdef	USE_ASM_CTX
+	return fiber_create(fn, arg, 0, FIBER_F_SHARED);
+#else
+	static int __warned = 0;
+
+	if (!__warned) {
+		__warned = 1;
+		acl_msg_warn("%s(%d), %s: the shared stack needs the assembly "
+			"context switching, use a stack of %lu instead",
+			__FILE__, __LINE__, __FUNCTION__,
+			(unsigned long) __shared_stack_size);
+	}
+	return fiber_create(fn, arg, __shared_stack_size, 0);
+#endif
+}
+
 unsigned int acl_fiber_id(const ACL_FIBER *fiber)
 {
 	return fiber ? fiber->id : 0;
@@ -668,6 +1218,144 @@ int acl_fiber_status(const ACL_FIBER *fiber)
 	return fiber ? fiber->status : 0;
 }
 
+void acl_fiber_profile(int onoff)
+{
+	fiber_profile_on = onoff;
+}
+
+int acl_fiber_stat(const ACL_FIBER *fiber, ACL_FIBER_STAT *stat)
+{
+	memset(stat, 0, sizeof(*stat));
+
+	if (fiber == NULL && (fiber = acl_fiber_running()) == NULL)
+		return -1;
+
+	stat->id          = fiber->id;
+	stat->status      = fiber->status;
+	stat->sys         = fiber->sys;
+	stat->stack_size  = fiber->size;
+	stat->nswitch     = fiber->nswitch;
+	stat->nwait_io    = fiber->nwait_io;
+	stat->nwait_timer = fiber->nwait_timer;
+	stat->run_ns      = fiber->run_ns;
+	stat->io_ns       = fiber->io_ns;
+	stat->timer_ns    = fiber->timer_ns;
+
+	/* add the time of the running one till now */
+	if (__thread_fiber && fiber == __thread_fiber->running
+		&& __thread_fiber->begin > 0) {
+
+		long long now;
+
+		FIBER_NS(now);
+		stat->run_ns += now - __thread_fiber->begin;
+	}
+
+	return 0;
+}
+
+int acl_fiber_stat_list(ACL_FIBER_STAT *stats, int max)
+{
+	unsigned i;
+	int n = 0;
+
+	if (__thread_fiber == NULL)
+		return 0;
+
+	for (i = 0; i < __thread_fiber->slot && n < max; i++)
+		acl_fiber_stat(__thread_fiber->fibers[i], &stats[n++]);
+	return n;
+}
+
+void acl_fiber_sched_stat(ACL_FIBER_SCHED_STAT *stat)
+{
+	memset(stat, 0, sizeof(*stat));
+
+	if (__thread_fiber == NULL)
+		return;
+
+	stat->nfibers  = __thread_fiber->count;
+	stat->nready   = acl_ring_size(&__thread_fiber->ready);
+	stat->ndead    = acl_ring_size(&__thread_fiber->dead);
+	stat->nswitch  = __thread_fiber->nswitch;
+	stat->sched_ns = __thread_fiber->original.run_ns;
+
+	fiber_io_stat(stat);
+}
+
+static int stat_cmp(const void *a, const void *b)
+{
+	const ACL_FIBER_STAT *x = (const ACL_FIBER_STAT *) a;
+	const ACL_FIBER_STAT *y = (const ACL_FIBER_STAT *) b;
+
+	/* order by the switches if not profiling */
+	if (x->run_ns != y->run_ns)
+		return x->run_ns < y->run_ns ? 1 : -1;
+	if (x->nswitch != y->nswitch)
+		return x->nswitch < y->nswitch ? 1 : -1;
+	return 0;
+}
+
+static const char *stat_status(int status)
+{
+	switch (status) {
+	case FIBER_STATUS_READY:
+		return "ready";
+	case FIBER_STATUS_RUNNING:
+		return "running";
+	case FIBER_STATUS_EXITING:
+		return "exiting";
+	default:
+		return "unknown";
+	}
+}
+
+#define	MS(ns)	((double) (ns) / 1000000.0)
+
+int acl_fiber_stat_top(char *buf, size_t size, int max)
+{
+	ACL_FIBER_SCHED_STAT sched;
+	ACL_FIBER_STAT *stats;
+	size_t len;
+	int i, n = 0;
+
+	acl_fiber_sched_stat(&sched);
+
+	len = snprintf(buf, size, "thread=%lu, fibers=%d, ready=%d, "
+		"wait_io=%d, sleeping=%d, dead=%d, switches=%llu, loops=%llu, "
+		"sched=%.3fms, idle=%.3fms, profiling=%s\r\n",
+		(unsigned long) acl_pthread_self(), sched.nfibers,
+		sched.nready, sched.nwait_io, sched.nsleeping, sched.ndead,
+		sched.nswitch, sched.nloop, MS(sched.sched_ns),
+		MS(sched.idle_ns), fiber_profile_on ? "on" : "off");
+
+	if (__thread_fiber == NULL || __thread_fiber->slot == 0)
+		return (int) len;
+
+	stats = (ACL_FIBER_STAT *) acl_mymalloc(__thread_fiber->slot
+		* sizeof(ACL_FIBER_STAT));
+	n = acl_fiber_stat_list(stats, (int) __thread_fiber->slot);
+	qsort(stats, n, sizeof(ACL_FIBER_STAT), stat_cmp);
+
+	for (i = 0; i < n && max > 0 && len < size; i++) {
+		/* the IO loop's running time includes waiting for events */
+		if (stats[i].sys)
+			continue;
+
+		len += snprintf(buf + len, size - len, "fiber=%u, status=%s, "
+			"switches=%llu, run=%.3fms, io=%llu/%.3fms, "
+			"timer=%llu/%.3fms\r\n", stats[i].id,
+			stat_status(stats[i].status), stats[i].nswitch,
+			MS(stats[i].run_ns), stats[i].nwait_io,
+			MS(stats[i].io_ns), stats[i].nwait_timer,
+			MS(stats[i].timer_ns));
+		max--;
+	}
+
+	acl_myfree(stats);
+	return (int) (len < size ? len : size > 0 ? size - 1 : 0);
+}
+
 static void fiber_init(void)
 {
 	static acl_pthread_mutex_t __lock = PTHREAD_MUTEX_INITIALIZER;
@@ -705,14 +1393,13 @@ void acl_fiber_schedule(void)
 	__scheduled = 1;
 
 	for (;;) {
-		head = acl_ring_pop_head(&__thread_fiber->ready);
-		if (head == NULL) {
+		fiber = ready_pop(__thread_fiber);
+		if (fiber == NULL) {
 			acl_msg_info("thread-%lu: NO ACL_FIBER NOW",
 				acl_pthread_self());
 			break;
 		}
 
-		fiber = ACL_RING_TO_APPL(head, ACL_FIBER, me);
 		fiber->status = FIBER_STATUS_READY;
 
 		__thread_fiber->running = fiber;
@@ -732,11 +1419,113 @@ void acl_fiber_schedule(void)
 	__scheduled = 0;
 }
 
+static void fiber_mn_join(int index)
+{
+	fiber_check();
+
+	__thread_fiber->mn      = 1;
+	__thread_fiber->index   = index;
+	__thread_fiber->victim  = index + 1;
+	__group->threads[index] = __thread_fiber;
+
+	fiber_io_mn_join(index);
+}
+
+/* wait for all the threads stopping scheduling before any one exits, so
+ * none of them will be stolen from after exiting.
+ */
+static void fiber_mn_leave(void)
+{
+	acl_pthread_mutex_lock(&__group->lock);
+	if (--__group->nrunning == 0)
+		acl_pthread_cond_broadcast(&__group->cond);
+	else {
+		while (__group->nrunning > 0)
+			acl_pthread_cond_wait(&__group->cond, &__group->lock);
+	}
+	acl_pthread_mutex_unlock(&__group->lock);
+
+	fiber_io_mn_leave();
+	__thread_fiber->mn = 0;
+}
+
+static void *fiber_mn_thread(void *ctx)
+{
+	fiber_mn_join((int) (long) ctx);
+	acl_fiber_schedule();
+	fiber_mn_leave();
+	return NULL;
+}
+
+void acl_fiber_schedule_mn(int nthreads)
+{
+	acl_pthread_t *tids;
+	int i;
+
+	if (nthreads <= 1) {
+		acl_fiber_schedule();
+		return;
+	}
+
+	if (__group != NULL) {
+		acl_msg_error("%s(%d), %s: already scheduling in M:N mode",
+			__FILE__, __LINE__, __FUNCTION__);
+		return;
+	}
+
+	fiber_check();
+
+	__group = (FIBER_GROUP *) acl_mycalloc(1, sizeof(FIBER_GROUP));
+	__group->threads  = (FIBER_TLS **)
+		acl_mycalloc(nthreads, sizeof(FIBER_TLS *));
+	__group->nthreads = nthreads;
+	__group->nrunning = nthreads;
+	__group->nfibers  = __thread_fiber->count;
+	__group->nlocal   = __thread_fiber->nlocal;
+	__group->idgen    = __thread_fiber->idgen;
+	acl_pthread_mutex_init(&__group->lock, NULL);
+	acl_pthread_cond_init(&__group->cond, NULL);
+
+	fiber_io_mn_init(nthreads);
+	fiber_mn_join(0);
+
+	tids = (acl_pthread_t *) acl_mycalloc(nthreads, sizeof(acl_pthread_t));
+	for (i = 1; i < nthreads; i++) {
+		if (acl_pthread_create(&tids[i], NULL, fiber_mn_thread,
+			(void *) (long) i) != 0) {
+
+			acl_msg_fatal("%s(%d), %s: pthread_create error %s",
+				__FILE__, __LINE__, __FUNCTION__,
+				acl_last_serror());
+		}
+	}
+
+	acl_fiber_schedule();
+	fiber_mn_leave();
+
+	for (i = 1; i < nthreads; i++)
+		acl_pthread_join(tids[i], NULL);
+
+	fiber_io_mn_end();
+
+	__thread_fiber->idgen  = __group->idgen;
+	__thread_fiber->nlocal = __group->nlocal;
+
+	acl_pthread_cond_destroy(&__group->cond);
+	acl_pthread_mutex_destroy(&__group->lock);
+	acl_myfree(tids);
+	acl_myfree(__group->threads);
+	acl_myfree(__group);
+	__group = NULL;
+}
+
 void fiber_system(void)
 {
 	if (!__thread_fiber->running->sys) {
 		__thread_fiber->running->sys = 1;
 		__thread_fiber->count--;
+		if (__thread_fiber->mn)
+			fiber_mn_exit();
 	}
 }
 
@@ -753,20 +1542,27 @@ void fiber_count_dec(void)
 void acl_fiber_switch(void)
 {
 	ACL_FIBER *fiber, *current = __thread_fiber->running;
-	ACL_RING *head;
 
 #ifdef _DEBUG
 	acl_assert(current);
 #endif
 
-	head = acl_ring_pop_head(&__thread_fiber->ready);
+	fiber = ready_pop(__thread_fiber);
 
-	if (head == NULL) {
+	if (fiber == NULL) {
 		fiber_swap(current, &__thread_fiber->original);
 		return;
 	}
 
-	fiber = ACL_RING_TO_APPL(head, ACL_FIBER, me);
+#ifdef	USE_ASM_CTX
+	/* the shared stack can't be restored by the fiber running on it */
+	if ((current->flag & fiber->flag & FIBER_F_SHARED) && fiber != current) {
+		ready_push(__thread_fiber, fiber, 1);
+		fiber_swap(current, &__thread_fiber->original);
+		return;
+	}
+#endif
+
 	//fiber->status = FIBER_STATUS_READY;
 
 	__thread_fiber->running = fiber;
@@ -778,6 +1574,7 @@ int acl_fiber_set_specific(int *key, void *ctx, void (*free_fn)(void *))
 {
 	FIBER_LOCAL *local;
 	ACL_FIBER *curr;
+	int nlocal;
 
 	if (key == NULL) {
 		acl_msg_error("%s(%d), %s: key NULL",
@@ -796,18 +1593,26 @@ int acl_fiber_set_specific(int *key, void *ctx, void (*free_fn)(void *))
 	} else
 		curr = __thread_fiber->running;
 
-	if (*key <= 0)
-		*key = ++__thread_fiber->nlocal;
-	else if (*key > __thread_fiber->nlocal) {
+	/* the keys are shared by all the threads in M:N mode */
+	if (__thread_fiber->mn) {
+		if (*key <= 0)
+			*key = __sync_add_and_fetch(&__group->nlocal, 1);
+		nlocal = __group->nlocal;
+	} else {
+		if (*key <= 0)
+			*key = ++__thread_fiber->nlocal;
+		nlocal = __thread_fiber->nlocal;
+	}
+
+	if (*key > nlocal) {
 		acl_msg_error("%s(%d), %s: invalid key: %d > nlocal: %d",
-			__FILE__, __LINE__, __FUNCTION__,
-			*key, __thread_fiber->nlocal);
+			__FILE__, __LINE__, __FUNCTION__, *key, nlocal);
 		return -1;
 	}
 
-	if (curr->nlocal < __thread_fiber->nlocal) {
+	if (curr->nlocal < nlocal) {
 		int i, n = curr->nlocal;
-		curr->nlocal = __thread_fiber->nlocal;
+		curr->nlocal = nlocal;
 		curr->locals = (FIBER_LOCAL **) acl_myrealloc(curr->locals,
 			curr->nlocal * sizeof(FIBER_LOCAL*));
 		for (i = n; i < curr->nlocal; i++)
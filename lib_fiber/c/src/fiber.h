@@ -1,10 +1,21 @@
 #ifndef FIBER_INCLUDE_H
 #define FIBER_INCLUDE_H
 
+#include <signal.h>
 #include <ucontext.h>
 #include <setjmp.h>
 #include "event.h"
 
+/* The fiber context switching is selected when building: on x86_64 and
+ * aarch64 the assembly switching is used by default, which saves only the
+ * callee-saved registers and never calls sigprocmask; define USE_JMP to
+ * use setjmp/longjmp, or USE_UCONTEXT to use swapcontext.
+ */
+#if !defined(USE_JMP) && !defined(USE_UCONTEXT) && defined(__linux__) \
+	&& (defined(__x86_64__) || defined(__aarch64__))
+# define USE_ASM_CTX
+#endif
+
 #ifdef ACL_ARM_LINUX
 extern int getcontext(ucontext_t *ucp);
 extern int setcontext(const ucontext_t *ucp);
@@ -32,12 +43,15 @@ struct ACL_FIBER {
 	unsigned       id;
 	unsigned       slot;
 	acl_int64      when;
+	unsigned       tindex;
 	int            errnum;
 	int            sys;
 	int            signum;
 	unsigned int   flag;
 #define FIBER_F_SAVE_ERRNO	(unsigned) 1 << 0
 #define	FIBER_F_KILLED		(unsigned) 1 << 1
+#define	FIBER_F_PINNED		(unsigned) 1 << 2  /* not stolen in M:N mode */
+#define	FIBER_F_SHARED		(unsigned) 1 << 3  /* using the shared stack */
 
 	FIBER_LOCAL  **locals;
 	int            nlocal;
@@ -48,15 +62,48 @@ struct ACL_FIBER {
 # else
 	sigjmp_buf     env;
 # endif
+#elif	defined(USE_ASM_CTX)
+	void          *sp;
 #endif
 	ucontext_t    *context;
 	void         (*fn)(ACL_FIBER *, void *);
 	void          *arg;
 	void         (*timer_fn)(ACL_FIBER *, void *);
 	size_t         size;
-	char          *buff;
+	char          *buff;		/* the stack saved if FIBER_F_SHARED */
+	size_t         used;		/* the length of the stack saved */
+
+	/* the counters for profiling, the times are counted in nanoseconds
+	 * only when acl_fiber_profile is on.
+	 */
+	unsigned long long nswitch;	/* the times being switched to run */
+	unsigned long long nwait_io;	/* the times waiting for IO */
+	unsigned long long nwait_timer;	/* the times in acl_fiber_delay */
+	long long      run_ns;		/* the time running */
+	long long      io_ns;		/* the time waiting for IO */
+	long long      timer_ns;	/* the time in acl_fiber_delay */
 };
 
+extern int fiber_profile_on;
+
+#define	FIBER_NS(x) do {  \
+	struct timespec _ts;  \
+	clock_gettime(CLOCK_MONOTONIC, &_ts);  \
+	(x) = ((long long) _ts.tv_sec) * 1000000000LL + _ts.tv_nsec;  \
+} while (0)
+
+/* measure the time of waiting by acl_fiber_switch into *ns */
+#define	FIBER_WAIT(ns) do {  \
+	if (fiber_profile_on) {  \
+		long long _begin, _end;  \
+		FIBER_NS(_begin);  \
+		acl_fiber_switch();  \
+		FIBER_NS(_end);  \
+		(ns) += _end - _begin;  \
+	} else  \
+		acl_fiber_switch();  \
+} while (0)
+
 /*
  * channel communication
  */
@@ -115,6 +162,37 @@ struct ACL_FIBER_SEM {
 	acl_pthread_t tid;
 };
 
+/* a fiber waiting for being waked up by other threads */
+typedef struct FIBER_WAITER {
+	ACL_RING   me;
+	ACL_FIBER *fiber;	/* NULL if not in any fiber */
+	void      *tls;		/* the fiber IO of the fiber's thread */
+	int        waked;	/* set in the fiber's thread when waked up */
+} FIBER_WAITER;
+
+typedef struct CHAN_SLOT {
+	volatile size_t seq;
+	void  *data;
+} CHAN_SLOT;
+
+#define	CACHE_LINE	64
+
+struct ACL_FIBER_CHAN {
+	CHAN_SLOT *slots;
+	size_t     mask;
+	char       pad1[CACHE_LINE];
+	volatile size_t head;	/* the position to send to */
+	char       pad2[CACHE_LINE];
+	volatile size_t tail;	/* the position to receive from */
+	char       pad3[CACHE_LINE];
+	acl_pthread_mutex_t lock;	/* protecting the waiting lists */
+	acl_pthread_cond_t  cond;	/* for the waiters not in fibers */
+	ACL_RING   rwaiting;
+	ACL_RING   swaiting;
+	volatile int nrwait;
+	volatile int nswait;
+};
+
 /* in fiber.c */
 extern __thread int acl_var_hook_sys_api;
 void fiber_free(ACL_FIBER *fiber);
@@ -125,16 +203,68 @@ void fiber_exit(int exit_code);
 void fiber_system(void);
 void fiber_count_inc(void);
 void fiber_count_dec(void);
+int  fiber_mn_steal(void);
 
 /* in fiber_io.c */
 void fiber_io_check(void);
 void fiber_io_close(int fd);
 void fiber_wait_read(int fd);
 void fiber_wait_write(int fd);
+void fiber_io_timer_del(ACL_FIBER *fiber);
 void fiber_io_dec(void);
 void fiber_io_inc(void);
 EVENT *fiber_io_event(void);
 void fiber_io_fibers_free(void);
+void fiber_io_mn_init(int nthreads);
+void fiber_io_mn_join(int index);
+void fiber_io_mn_leave(void);
+void fiber_io_mn_end(void);
+void fiber_io_mn_wakeup(void);
+void fiber_io_mn_stop(void);
+void fiber_io_waiter(FIBER_WAITER *waiter);
+void fiber_io_wakeup(FIBER_WAITER *waiter);
+void fiber_io_stat(ACL_FIBER_SCHED_STAT *stat);
+
+/* in fiber_uring.c */
+#ifdef	HAS_IO_URING
+int     fiber_io_uring(int fd);
+ssize_t fiber_uring_read(int fd, void *buf, size_t count);
+ssize_t fiber_uring_readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t fiber_uring_recv(int sockfd, void *buf, size_t len, int flags);
+ssize_t fiber_uring_recvfrom(int sockfd, void *buf, size_t len, int flags,
+	struct sockaddr *src_addr, socklen_t *addrlen);
+ssize_t fiber_uring_recvmsg(int sockfd, struct msghdr *msg, int flags);
+ssize_t fiber_uring_write(int fd, const void *buf, size_t count);
+ssize_t fiber_uring_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t fiber_uring_send(int sockfd, const void *buf, size_t len, int flags);
+ssize_t fiber_uring_sendto(int sockfd, const void *buf, size_t len, int flags,
+	const struct sockaddr *dest_addr, socklen_t addrlen);
+ssize_t fiber_uring_sendmsg(int sockfd, const struct msghdr *msg, int flags);
+int     fiber_uring_accept(int sockfd, struct sockaddr *addr,
+	socklen_t *addrlen);
+int     fiber_uring_connect(int sockfd, const struct sockaddr *addr,
+	socklen_t addrlen);
+#endif
+
+/* in fiber_file.c */
+int     fiber_file_io(int fd);
+int     fiber_file_open(const char *path, int flags, mode_t mode);
+ssize_t fiber_file_read(int fd, void *buf, size_t count);
+ssize_t fiber_file_readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t fiber_file_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t fiber_file_write(int fd, const void *buf, size_t count);
+ssize_t fiber_file_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t fiber_file_pwrite(int fd, const void *buf, size_t count,
+	off_t offset);
+int     fiber_file_fsync(int fd);
+int     fiber_file_fdatasync(int fd);
+
+/* in fiber_dns.c */
+ACL_ARGV *fiber_dns_lookup(const char *name, int *herr);
+
+/* in fiber_stack.c */
+char *fiber_stack_alloc(size_t *size);
+void  fiber_stack_free(char *stack, size_t size);
 
 /* in hook_io.c */
 void hook_io(void);
@@ -0,0 +1,319 @@
+#include "stdafx.h"
+#include "fiber/lib_fiber.h"
+#include "fiber.h"
+
+/* The bounded MPMC queue of the channel is lock free: each slot has a
+ * sequence number telling which round of the positions it's ready for,
+ * the senders and receivers claim the positions by CAS and wait for the
+ * slots' sequence only. The lock is used just for the waiting lists when
+ * the channel is empty or full, the waiters are counted so the wakers can
+ * skip the lock when nobody is waiting.
+ */
+
+ACL_FIBER_CHAN *acl_fiber_chan_create(size_t capacity)
+{
+	ACL_FIBER_CHAN *chan;
+	size_t size = 2, i;
+
+	while (size < capacity)
+		size <<= 1;
+
+	chan = (ACL_FIBER_CHAN *) acl_mycalloc(1, sizeof(ACL_FIBER_CHAN));
+	chan->slots = (CHAN_SLOT *) acl_mycalloc(size, sizeof(CHAN_SLOT));
+	chan->mask  = size - 1;
+	for (i = 0; i < size; i++)
+		chan->slots[i].seq = i;
+
+	acl_pthread_mutex_init(&chan->lock, NULL);
+	acl_pthread_cond_init(&chan->cond, NULL);
+	acl_ring_init(&chan->rwaiting);
+	acl_ring_init(&chan->swaiting);
+	return chan;
+}
+
+void acl_fiber_chan_free(ACL_FIBER_CHAN *chan)
+{
+	if (chan->nrwait > 0 || chan->nswait > 0)
+		acl_msg_fatal("%s(%d), %s: waiting recv=%d, send=%d",
+			__FILE__, __LINE__, __FUNCTION__,
+			chan->nrwait, chan->nswait);
+
+	acl_pthread_cond_destroy(&chan->cond);
+	acl_pthread_mutex_destroy(&chan->lock);
+	acl_myfree(chan->slots);
+	acl_myfree(chan);
+}
+
+#define	SEQ_LOAD(slot)	__atomic_load_n(&(slot)->seq, __ATOMIC_ACQUIRE)
+#define	SEQ_STORE(slot, n)  \
+	__atomic_store_n(&(slot)->seq, (n), __ATOMIC_RELEASE)
+
+static int chan_push(ACL_FIBER_CHAN *chan, void *ptr)
+{
+	CHAN_SLOT *slot;
+	size_t pos = chan->head;
+	long   diff;
+
+	for (;;) {
+		slot = &chan->slots[pos & chan->mask];
+		diff = (long) (SEQ_LOAD(slot) - pos);
+		if (diff == 0) {
+			if (__sync_bool_compare_and_swap(&chan->head,
+				pos, pos + 1)) {
+				break;
+			}
+		} else if (diff < 0)
+			return 0;  /* the slot hasn't been received: full */
+		pos = chan->head;
+	}
+
+	slot->data = ptr;
+	SEQ_STORE(slot, pos + 1);
+	return 1;
+}
+
+static void *chan_pop(ACL_FIBER_CHAN *chan)
+{
+	CHAN_SLOT *slot;
+	size_t pos = chan->tail;
+	long   diff;
+	void  *ptr;
+
+	for (;;) {
+		slot = &chan->slots[pos & chan->mask];
+		diff = (long) (SEQ_LOAD(slot) - (pos + 1));
+		if (diff == 0) {
+			if (__sync_bool_compare_and_swap(&chan->tail,
+				pos, pos + 1)) {
+				break;
+			}
+		} else if (diff < 0)
+			return NULL;  /* the slot hasn't been sent: empty */
+		pos = chan->tail;
+	}
+
+	ptr = slot->data;
+	SEQ_STORE(slot, pos + chan->mask + 1);
+	return ptr;
+}
+
+static int chan_empty(ACL_FIBER_CHAN *chan)
+{
+	size_t pos = chan->tail;
+	CHAN_SLOT *slot = &chan->slots[pos & chan->mask];
+
+	return (long) (SEQ_LOAD(slot) - (pos + 1)) < 0;
+}
+
+static int chan_full(ACL_FIBER_CHAN *chan)
+{
+	size_t pos = chan->head;
+	CHAN_SLOT *slot = &chan->slots[pos & chan->mask];
+
+	return (long) (SEQ_LOAD(slot) - pos) < 0;
+}
+
+#define	RING_TO_WAITER(r) \
+	((FIBER_WAITER *) ((char *) (r) - offsetof(FIBER_WAITER, me)))
+
+/* wake up at most n of the waiters in the list */
+static void chan_wakeup(ACL_FIBER_CHAN *chan, ACL_RING *list,
+	volatile int *nwait, int n)
+{
+	FIBER_WAITER *waiter;
+	ACL_RING *r;
+	int cond = 0;
+
+	/* pairs with the barrier in chan_wait: either the waiter sees the
+	 * change of the queue, or the count of the waiters is seen here.
+	 */
+	__sync_synchronize();
+	if (*nwait == 0)
+		return;
+
+	acl_pthread_mutex_lock(&chan->lock);
+	while (n-- > 0 && (r = acl_ring_pop_head(list)) != NULL) {
+		waiter = RING_TO_WAITER(r);
+		(*nwait)--;
+
+		if (waiter->fiber != NULL)
+			fiber_io_wakeup(waiter);
+		else {
+			waiter->waked = 1;
+			cond = 1;
+		}
+	}
+	if (cond)
+		acl_pthread_cond_broadcast(&chan->cond);
+	acl_pthread_mutex_unlock(&chan->lock);
+}
+
+/* wait in the list until being waked up when blocked() is true, return -1
+ * if the fiber is killed when waiting.
+ */
+static int chan_wait(ACL_FIBER_CHAN *chan, ACL_RING *list,
+	volatile int *nwait, int (*blocked)(ACL_FIBER_CHAN *))
+{
+	FIBER_WAITER waiter;
+
+	fiber_io_waiter(&waiter);
+
+	acl_pthread_mutex_lock(&chan->lock);
+	(*nwait)++;
+	__sync_synchronize();
+
+	/* check again after being counted for the wakers */
+	if (!blocked(chan)) {
+		(*nwait)--;
+		acl_pthread_mutex_unlock(&chan->lock);
+		return 0;
+	}
+
+	acl_ring_append(list, &waiter.me);
+
+	if (waiter.fiber == NULL) {
+		while (!waiter.waked)
+			acl_pthread_cond_wait(&chan->cond, &chan->lock);
+		acl_pthread_mutex_unlock(&chan->lock);
+		return 0;
+	}
+
+	fiber_io_inc();
+	acl_pthread_mutex_unlock(&chan->lock);
+
+	acl_fiber_switch();
+
+	if (!waiter.waked) {
+		/* waked up by acl_fiber_kill or acl_fiber_signal */
+		acl_pthread_mutex_lock(&chan->lock);
+		if (waiter.me.parent == list) {
+			acl_ring_detach(&waiter.me);
+			(*nwait)--;
+			acl_pthread_mutex_unlock(&chan->lock);
+			fiber_io_dec();
+		} else {
+			/* being waked up by another thread at the same time,
+			 * the waiter mustn't be left in its list.
+			 */
+			acl_pthread_mutex_unlock(&chan->lock);
+			while (!waiter.waked)
+				acl_fiber_switch();
+		}
+	}
+
+	if (!acl_fiber_killed(waiter.fiber))
+		return 0;
+
+	/* pass the wakeup to another waiter for not being used */
+	if (waiter.waked)
+		chan_wakeup(chan, list, nwait, 1);
+	return -1;
+}
+
+int acl_fiber_chan_trysend(ACL_FIBER_CHAN *chan, void *ptr)
+{
+	if (!chan_push(chan, ptr))
+		return -1;
+
+	chan_wakeup(chan, &chan->rwaiting, &chan->nrwait, 1);
+	return 0;
+}
+
+int acl_fiber_chan_send(ACL_FIBER_CHAN *chan, void *ptr)
+{
+	while (!chan_push(chan, ptr)) {
+		if (chan_wait(chan, &chan->swaiting, &chan->nswait,
+			chan_full) < 0) {
+
+			return -1;
+		}
+	}
+
+	chan_wakeup(chan, &chan->rwaiting, &chan->nrwait, 1);
+	return 0;
+}
+
+int acl_fiber_chan_send_batch(ACL_FIBER_CHAN *chan, void **ptrs, int n)
+{
+	int i = 0, nsent = 0;
+
+	while (i < n) {
+		if (chan_push(chan, ptrs[i])) {
+			i++;
+			continue;
+		}
+
+		/* wake up the receivers before waiting for them */
+		if (i > nsent) {
+			chan_wakeup(chan, &chan->rwaiting, &chan->nrwait,
+				i - nsent);
+			nsent = i;
+		}
+
+		if (chan_wait(chan, &chan->swaiting, &chan->nswait,
+			chan_full) < 0) {
+
+			break;
+		}
+	}
+
+	if (i > nsent)
+		chan_wakeup(chan, &chan->rwaiting, &chan->nrwait, i - nsent);
+	return i;
+}
+
+void *acl_fiber_chan_tryrecv(ACL_FIBER_CHAN *chan)
+{
+	void *ptr = chan_pop(chan);
+
+	if (ptr != NULL)
+		chan_wakeup(chan, &chan->swaiting, &chan->nswait, 1);
+	return ptr;
+}
+
+void *acl_fiber_chan_recv(ACL_FIBER_CHAN *chan)
+{
+	void *ptr;
+
+	while ((ptr = chan_pop(chan)) == NULL) {
+		if (chan_wait(chan, &chan->rwaiting, &chan->nrwait,
+			chan_empty) < 0) {
+
+			return NULL;
+		}
+	}
+
+	chan_wakeup(chan, &chan->swaiting, &chan->nswait, 1);
+	return ptr;
+}
+
+int acl_fiber_chan_recv_batch(ACL_FIBER_CHAN *chan, void **ptrs, int max)
+{
+	int n = 0;
+
+	if (max <= 0)
+		return 0;
+
+	while ((ptrs[0] = chan_pop(chan)) == NULL) {
+		if (chan_wait(chan, &chan->rwaiting, &chan->nrwait,
+			chan_empty) < 0) {
+
+			return 0;
+		}
+	}
+
+	for (n = 1; n < max; n++) {
+		if ((ptrs[n] = chan_pop(chan)) == NULL)
+			break;
+	}
+
+	chan_wakeup(chan, &chan->swaiting, &chan->nswait, n);
+	return n;
+}
+
+size_t acl_fiber_chan_size(ACL_FIBER_CHAN *chan)
+{
+	size_t head = chan->head, tail = chan->tail;
+
+	return head > tail ? head - tail : 0;
+}
@@ -0,0 +1,438 @@
+#include "stdafx.h"
+#include <netdb.h>
+#include "fiber/lib_fiber.h"
+#include "fiber.h"
+
+/* The names resolved by the hooked gethostbyname_r and getaddrinfo are
+ * cached for the whole process, with the TTL of the answers, and the names
+ * not existing are cached for a short while too. Only one query is sent
+ * for the same name at the same time: the fibers looking up a name being
+ * queried wait in its entry, and are waked up with the result even if
+ * they're in other threads. The nameservers are tried in turn, starting
+ * from the last one answered, when one of them is timeout or failed.
+ */
+
+#define	DNS_MAX_SERVER	8
+#define	DNS_MAX_NAME	256
+
+typedef struct DNS_SERVER {
+	char  ip[64];
+	int   port;
+} DNS_SERVER;
+
+enum {
+	DNS_PENDING,
+	DNS_DONE,
+};
+
+typedef struct DNS_ENTRY {
+	char      *name;
+	int        status;
+	int        herr;	/* 0, HOST_NOT_FOUND or TRY_AGAIN */
+	ACL_ARGV  *ips;
+	time_t     expire;
+	ACL_RING   waiters;
+} DNS_ENTRY;
+
+typedef struct DNS_WAITER {
+	FIBER_WAITER waiter;
+	ACL_ARGV    *ips;
+	int          herr;
+} DNS_WAITER;
+
+static DNS_SERVER __servers[DNS_MAX_SERVER];
+static int    __nservers     = 0;
+static int    __server_set   = 0;	/* set by the application */
+static int    __server_last  = 0;	/* the last one answered */
+static int    __dns_timeout  = 0;	/* seconds, 0 for resolv.conf's */
+static int    __dns_attempts = 0;
+static int    __dns_max_ttl  = 300;
+static int    __dns_neg_ttl  = 5;
+static int    __dns_max      = 10000;	/* the max names cached */
+static const char *__dns_ip_default = "8.8.8.8";
+
+static ACL_HTABLE *__dns_cache = NULL;
+static acl_pthread_mutex_t __dns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void acl_fiber_set_dns(const char* ip, int port)
+{
+	acl_pthread_mutex_lock(&__dns_lock);
+	__nservers   = 0;
+	__server_set = 0;
+	__server_last = 0;
+	acl_pthread_mutex_unlock(&__dns_lock);
+
+	if (ip != NULL && *ip != 0)
+		acl_fiber_add_dns(ip, port);
+}
+
+void acl_fiber_add_dns(const char* ip, int port)
+{
+	acl_pthread_mutex_lock(&__dns_lock);
+
+	if (!__server_set) {
+		__nservers   = 0;
+		__server_set = 1;
+	}
+
+	if (__nservers < DNS_MAX_SERVER) {
+		DNS_SERVER *server = &__servers[__nservers++];
+
+		ACL_SAFE_STRNCPY(server->ip, ip, sizeof(server->ip));
+		server->port = port > 0 ? port : 53;
+	}
+
+	acl_pthread_mutex_unlock(&__dns_lock);
+}
+
+void acl_fiber_dns_set_timeout(int timeout, int attempts)
+{
+	__dns_timeout  = timeout > 0 ? timeout : 0;
+	__dns_attempts = attempts > 0 ? attempts : 0;
+}
+
+void acl_fiber_dns_set_cache(int max_ttl, int neg_ttl, int max)
+{
+	__dns_max_ttl = max_ttl > 0 ? max_ttl : 0;
+	__dns_neg_ttl = neg_ttl > 0 ? neg_ttl : 0;
+	__dns_max     = max > 0 ? max : 0;
+}
+
+static void entry_free(DNS_ENTRY *entry)
+{
+	if (entry->ips)
+		acl_argv_free(entry->ips);
+	acl_myfree(entry->name);
+	acl_myfree(entry);
+}
+
+void acl_fiber_dns_clear(void)
+{
+	ACL_ITER iter;
+	ACL_ARGV *names = acl_argv_alloc(10);
+	int i;
+
+	acl_pthread_mutex_lock(&__dns_lock);
+
+	if (__dns_cache == NULL) {
+		acl_pthread_mutex_unlock(&__dns_lock);
+		acl_argv_free(names);
+		return;
+	}
+
+	/* the entries being queried are left for their waiters */
+	acl_foreach(iter, __dns_cache) {
+		DNS_ENTRY *entry = (DNS_ENTRY *) iter.data;
+		if (entry->status == DNS_DONE)
+			acl_argv_add(names, entry->name, NULL);
+	}
+
+	for (i = 0; i < names->argc; i++)
+		acl_htable_delete(__dns_cache, names->argv[i],
+			(void (*)(void *)) entry_free);
+
+	acl_pthread_mutex_unlock(&__dns_lock);
+	acl_argv_free(names);
+}
+
+#define SKIP_WHILE(cond, cp) { while (*cp && (cond)) cp++; }
+
+/* load the nameservers and the options from /etc/resolv.conf, the lock
+ * has been held.
+ */
+static void dns_load(void)
+{
+	const char *filepath = "/etc/resolv.conf";
+	ACL_VSTREAM *fp;
+	char buf[4096], *ptr;
+	ACL_ARGV *tokens;
+	int i;
+
+	fp = acl_vstream_fopen(filepath, O_RDONLY, 0600, 4096);
+	while (fp && acl_vstream_gets_nonl(fp, buf, sizeof(buf))
+		!= ACL_VSTREAM_EOF) {
+
+		ptr = buf;
+		SKIP_WHILE(*ptr == ' ' || *ptr == '\t', ptr);
+		if (*ptr == 0 || *ptr == '#' || *ptr == ';')
+			continue;
+
+		tokens = acl_argv_split(ptr, " \t");
+		if (tokens->argc < 2) {
+			acl_argv_free(tokens);
+			continue;
+		}
+
+		if (strcasecmp(tokens->argv[0], "nameserver") == 0) {
+			if (acl_is_ipv4(tokens->argv[1])
+				&& __nservers < DNS_MAX_SERVER) {
+
+				DNS_SERVER *server = &__servers[__nservers++];
+				ACL_SAFE_STRNCPY(server->ip, tokens->argv[1],
+					sizeof(server->ip));
+				server->port = 53;
+			}
+		} else if (strcasecmp(tokens->argv[0], "options") == 0) {
+			for (i = 1; i < tokens->argc; i++) {
+				ptr = tokens->argv[i];
+				if (!strncasecmp(ptr, "timeout:", 8)
+					&& __dns_timeout == 0) {
+
+					__dns_timeout = atoi(ptr + 8);
+				} else if (!strncasecmp(ptr, "attempts:", 9)
+					&& __dns_attempts == 0) {
+
+					__dns_attempts = atoi(ptr + 9);
+				}
+			}
+		}
+
+		acl_argv_free(tokens);
+	}
+
+	if (fp)
+		acl_vstream_close(fp);
+
+	if (__nservers == 0) {
+		ACL_SAFE_STRNCPY(__servers[0].ip, __dns_ip_default,
+			sizeof(__servers[0].ip));
+		__servers[0].port = 53;
+		__nservers = 1;
+	}
+
+	/* the defaults are shorter than the libc's for the services */
+	if (__dns_timeout <= 0)
+		__dns_timeout = 2;
+	if (__dns_attempts <= 0)
+		__dns_attempts = 2;
+}
+
+/* the server failed, rather than the name doesn't exist */
+#define	DNS_RETRY(e) ((e) == ACL_RES_ERR_SEND || (e) == ACL_RES_ERR_READ \
+	|| (e) == ACL_RES_ERR_RTMO || (e) == ACL_RES_ERR_CONN \
+	|| (e) == -2 /* SERVFAIL */ || (e) == -4 /* NOTIMP */ \
+	|| (e) == -5 /* REFUSED */ || (e) == -15 /* bad packet */)
+
+static ACL_ARGV *dns_query(const char *name, int *herr, unsigned *ttl)
+{
+	DNS_SERVER servers[DNS_MAX_SERVER];
+	ACL_DNS_DB *db;
+	ACL_RES *res;
+	ACL_ITER iter;
+	ACL_ARGV *ips = NULL;
+	int i, n, first, attempts, timeout, errnum = 0;
+
+	acl_pthread_mutex_lock(&__dns_lock);
+	if (__nservers == 0 || __dns_timeout == 0)
+		dns_load();
+	n = __nservers;
+	memcpy(servers, __servers, n * sizeof(DNS_SERVER));
+	first    = __server_last;
+	attempts = __dns_attempts;
+	timeout  = __dns_timeout;
+	acl_pthread_mutex_unlock(&__dns_lock);
+
+	*herr = TRY_AGAIN;
+
+	for (i = 0; i < attempts * n; i++) {
+		DNS_SERVER *server = &servers[(first + i) % n];
+
+		res = acl_res_new(server->ip, (unsigned short) server->port);
+		res->rw_timeout = timeout;
+		db = acl_res_lookup(res, name);
+		errnum = res->errnum;
+		acl_res_free(res);
+
+		if (db == NULL && DNS_RETRY(errnum))
+			continue;
+
+		__server_last = (first + i) % n;
+
+		if (db == NULL || db->size == 0) {
+			*herr = HOST_NOT_FOUND;
+			if (db)
+				acl_netdb_free(db);
+			return NULL;
+		}
+
+		ips  = acl_argv_alloc(db->size);
+		*ttl = (unsigned) -1;
+		acl_foreach(iter, db) {
+			const ACL_HOSTNAME *h = (const ACL_HOSTNAME *) iter.data;
+
+			acl_argv_add(ips, h->ip, NULL);
+			if (h->ttl < *ttl)
+				*ttl = h->ttl;
+		}
+
+		acl_netdb_free(db);
+		*herr = 0;
+		return ips;
+	}
+
+	acl_msg_error("%s(%d), %s: lookup %s failed from %d servers, %s",
+		__FILE__, __LINE__, __FUNCTION__, name, n,
+		acl_res_strerror(errnum));
+	return NULL;
+}
+
+static ACL_ARGV *argv_dup(const ACL_ARGV *argv)
+{
+	ACL_ARGV *copy;
+	int i;
+
+	if (argv == NULL)
+		return NULL;
+
+	copy = acl_argv_alloc(argv->argc > 0 ? argv->argc : 1);
+	for (i = 0; i < argv->argc; i++)
+		acl_argv_add(copy, argv->argv[i], NULL);
+	return copy;
+}
+
+static time_t dns_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* remove the entries expired when too many cached, the lock has been held */
+static void dns_expire(time_t now)
+{
+	ACL_ITER iter;
+	ACL_ARGV *names;
+	int i;
+
+	if (acl_htable_used(__dns_cache) < __dns_max)
+		return;
+
+	names = acl_argv_alloc(10);
+	acl_foreach(iter, __dns_cache) {
+		DNS_ENTRY *entry = (DNS_ENTRY *) iter.data;
+		if (entry->status == DNS_DONE && entry->expire <= now)
+			acl_argv_add(names, entry->name, NULL);
+	}
+
+	for (i = 0; i < names->argc; i++)
+		acl_htable_delete(__dns_cache, names->argv[i],
+			(void (*)(void *)) entry_free);
+	acl_argv_free(names);
+}
+
+#define	RING_TO_WAITER(r) \
+	((DNS_WAITER *) ((char *) (r) - offsetof(DNS_WAITER, waiter.me)))
+
+/* save the result of the query into the entry and wake up the waiters,
+ * the lock has been held.
+ */
+static void dns_done(DNS_ENTRY *entry, ACL_ARGV *ips, int herr, unsigned ttl)
+{
+	DNS_WAITER *waiter;
+	ACL_RING *r;
+	time_t now = dns_now();
+
+	entry->status = DNS_DONE;
+	entry->ips    = ips;
+	entry->herr   = herr;
+
+	if (herr == 0)
+		entry->expire = now + (ttl < (unsigned) __dns_max_ttl
+				? (time_t) ttl : __dns_max_ttl);
+	else if (herr == HOST_NOT_FOUND)
+		entry->expire = now + __dns_neg_ttl;
+	else
+		entry->expire = now;
+
+	while ((r = acl_ring_pop_head(&entry->waiters)) != NULL) {
+		waiter = RING_TO_WAITER(r);
+		waiter->ips  = argv_dup(ips);
+		waiter->herr = herr;
+		fiber_io_wakeup(&waiter->waiter);
+	}
+
+	/* the names failed or not cached are just for the waiters */
+	if (entry->expire <= now || acl_htable_used(__dns_cache) > __dns_max)
+		acl_htable_delete(__dns_cache, entry->name,
+			(void (*)(void *)) entry_free);
+}
+
+ACL_ARGV *fiber_dns_lookup(const char *name, int *herr)
+{
+	char key[DNS_MAX_NAME];
+	DNS_ENTRY *entry;
+	DNS_WAITER waiter;
+	ACL_ARGV *ips;
+	unsigned ttl = 0;
+	size_t len;
+	time_t now;
+
+	ACL_SAFE_STRNCPY(key, name, sizeof(key));
+	acl_lowercase(key);
+	len = strlen(key);
+	if (len > 1 && key[len - 1] == '.')
+		key[len - 1] = 0;
+
+	acl_pthread_mutex_lock(&__dns_lock);
+
+	if (__dns_cache == NULL)
+		__dns_cache = acl_htable_create(1024, 0);
+
+	now   = dns_now();
+	entry = (DNS_ENTRY *) acl_htable_find(__dns_cache, key);
+
+	if (entry && entry->status == DNS_DONE && entry->expire > now) {
+		ips   = argv_dup(entry->ips);
+		*herr = entry->herr;
+		acl_pthread_mutex_unlock(&__dns_lock);
+		return ips;
+	}
+
+	if (entry && entry->status == DNS_PENDING) {
+		fiber_io_waiter(&waiter.waiter);
+
+		/* not in any fiber, just query it without waiting */
+		if (waiter.waiter.fiber == NULL) {
+			acl_pthread_mutex_unlock(&__dns_lock);
+			ips = dns_query(key, herr, &ttl);
+			return ips;
+		}
+
+		waiter.ips  = NULL;
+		waiter.herr = TRY_AGAIN;
+		acl_ring_append(&entry->waiters, &waiter.waiter.me);
+		fiber_io_inc();
+		acl_pthread_mutex_unlock(&__dns_lock);
+
+		/* the waiter is in the entry, wait for it even if killed */
+		while (!waiter.waiter.waked)
+			acl_fiber_switch();
+
+		*herr = waiter.herr;
+		return waiter.ips;
+	}
+
+	if (entry == NULL) {
+		dns_expire(now);
+		entry = (DNS_ENTRY *) acl_mycalloc(1, sizeof(DNS_ENTRY));
+		entry->name = acl_mystrdup(key);
+		acl_ring_init(&entry->waiters);
+		acl_htable_enter(__dns_cache, key, entry);
+	} else if (entry->ips) {
+		acl_argv_free(entry->ips);
+		entry->ips = NULL;
+	}
+
+	entry->status = DNS_PENDING;
+	acl_pthread_mutex_unlock(&__dns_lock);
+
+	ips = dns_query(key, herr, &ttl);
+
+	acl_pthread_mutex_lock(&__dns_lock);
+	dns_done(entry, ips, *herr, ttl);
+	ips = argv_dup(ips);
+	acl_pthread_mutex_unlock(&__dns_lock);
+
+	return ips;
+}
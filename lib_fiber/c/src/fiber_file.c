@@ -0,0 +1,271 @@
+#include "stdafx.h"
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include "fiber/lib_fiber.h"
+#include "fiber.h"
+
+/* The regular files are always "ready" for epoll, but reading or writing
+ * them may block the thread for the disk, and all the fibers in the thread
+ * are stalled. So the IO of the regular files called in the fibers are
+ * done by a few helper threads: the fiber puts its request into the queue
+ * and yields, and it's waked up through the eventfd of its thread when the
+ * helper thread has done. The fibers using the shared stack do the IO
+ * directly, for the buffers on the stack can't be used by other threads.
+ */
+
+enum {
+	FILE_OPEN,
+	FILE_READ,
+	FILE_READV,
+	FILE_PREAD,
+	FILE_WRITE,
+	FILE_WRITEV,
+	FILE_PWRITE,
+	FILE_FSYNC,
+	FILE_FDATASYNC,
+};
+
+typedef struct FILE_JOB {
+	FIBER_WAITER waiter;
+	int         op;
+	int         fd;
+	void       *buf;
+	size_t      count;
+	off_t       offset;
+	const struct iovec *iov;
+	int         iovcnt;
+	const char *path;
+	int         flags;
+	mode_t      mode;
+	ssize_t     ret;
+	int         err;
+} FILE_JOB;
+
+static int __file_nthreads = 4;
+static ACL_FIBER_CHAN *__file_jobs = NULL;
+static acl_pthread_once_t __file_once = ACL_PTHREAD_ONCE_INIT;
+
+void acl_fiber_set_file_threads(int nthreads)
+{
+	__file_nthreads = nthreads >= 0 ? nthreads : 0;
+}
+
+/* the syscalls are used directly, never being hooked again */
+static void file_exec(FILE_JOB *job)
+{
+	switch (job->op) {
+	case FILE_OPEN:
+		job->ret = syscall(SYS_openat, AT_FDCWD, job->path,
+				job->flags, job->mode);
+		break;
+	case FILE_READ:
+		job->ret = syscall(SYS_read, job->fd, job->buf, job->count);
+		break;
+	case FILE_READV:
+		job->ret = syscall(SYS_readv, job->fd, job->iov, job->iovcnt);
+		break;
+	case FILE_PREAD:
+		job->ret = syscall(SYS_pread64, job->fd, job->buf,
+				job->count, job->offset);
+		break;
+	case FILE_WRITE:
+		job->ret = syscall(SYS_write, job->fd, job->buf, job->count);
+		break;
+	case FILE_WRITEV:
+		job->ret = syscall(SYS_writev, job->fd, job->iov, job->iovcnt);
+		break;
+	case FILE_PWRITE:
+		job->ret = syscall(SYS_pwrite64, job->fd, job->buf,
+				job->count, job->offset);
+		break;
+	case FILE_FSYNC:
+		job->ret = syscall(SYS_fsync, job->fd);
+		break;
+	case FILE_FDATASYNC:
+		job->ret = syscall(SYS_fdatasync, job->fd);
+		break;
+	default:
+		job->ret = -1;
+		errno = EINVAL;
+		break;
+	}
+
+	job->err = job->ret < 0 ? errno : 0;
+}
+
+static void *file_thread(void *ctx acl_unused)
+{
+	FILE_JOB *job;
+
+	for (;;) {
+		job = (FILE_JOB *) acl_fiber_chan_recv(__file_jobs);
+		file_exec(job);
+		fiber_io_wakeup(&job->waiter);
+	}
+
+	return NULL;
+}
+
+static void file_init(void)
+{
+	acl_pthread_attr_t attr;
+	acl_pthread_t tid;
+	int i;
+
+	__file_jobs = acl_fiber_chan_create(1024);
+
+	acl_pthread_attr_init(&attr);
+	acl_pthread_attr_setdetachstate(&attr, ACL_PTHREAD_CREATE_DETACHED);
+
+	for (i = 0; i < __file_nthreads; i++) {
+		if (acl_pthread_create(&tid, &attr, file_thread, NULL) != 0)
+			acl_msg_fatal("%s(%d), %s: create thread error %s",
+				__FILE__, __LINE__, __FUNCTION__,
+				acl_last_serror());
+	}
+
+	acl_pthread_attr_destroy(&attr);
+}
+
+/* check if the IO of the fd should be done by the helper threads, the fd
+ * is -1 for opening the file.
+ */
+int fiber_file_io(int fd)
+{
+	ACL_FIBER *me;
+
+	if (__file_nthreads == 0)
+		return 0;
+
+	me = acl_fiber_running();
+	if (me == NULL || (me->flag & FIBER_F_SHARED))
+		return 0;
+
+	return fd < 0 || event_isfile(fiber_io_event(), fd);
+}
+
+static ssize_t file_wait(FILE_JOB *job)
+{
+	if (acl_pthread_once(&__file_once, file_init) != 0)
+		acl_msg_fatal("%s(%d), %s: pthread_once error %s",
+			__FILE__, __LINE__, __FUNCTION__, acl_last_serror());
+
+	fiber_io_waiter(&job->waiter);
+	fiber_io_inc();
+
+	if (acl_fiber_chan_send(__file_jobs, job) < 0) {
+		/* killed when waiting for the full queue */
+		fiber_io_dec();
+		errno = ECANCELED;
+		return -1;
+	}
+
+	/* the job and the buffer are being used by the helper thread, so
+	 * wait for it even if being killed.
+	 */
+	job->waiter.fiber->nwait_io++;
+	while (!job->waiter.waked)
+		FIBER_WAIT(job->waiter.fiber->io_ns);
+
+	/* the errno is the running fiber's errnum for being hooked */
+	if (job->ret < 0)
+		errno = job->err;
+	return job->ret;
+}
+
+int fiber_file_open(const char *path, int flags, mode_t mode)
+{
+	FILE_JOB job;
+
+	job.op    = FILE_OPEN;
+	job.path  = path;
+	job.flags = flags;
+	job.mode  = mode;
+	return (int) file_wait(&job);
+}
+
+ssize_t fiber_file_read(int fd, void *buf, size_t count)
+{
+	FILE_JOB job;
+
+	job.op    = FILE_READ;
+	job.fd    = fd;
+	job.buf   = buf;
+	job.count = count;
+	return file_wait(&job);
+}
+
+ssize_t fiber_file_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	FILE_JOB job;
+
+	job.op     = FILE_READV;
+	job.fd     = fd;
+	job.iov    = iov;
+	job.iovcnt = iovcnt;
+	return file_wait(&job);
+}
+
+ssize_t fiber_file_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	FILE_JOB job;
+
+	job.op     = FILE_PREAD;
+	job.fd     = fd;
+	job.buf    = buf;
+	job.count  = count;
+	job.offset = offset;
+	return file_wait(&job);
+}
+
+ssize_t fiber_file_write(int fd, const void *buf, size_t count)
+{
+	FILE_JOB job;
+
+	job.op    = FILE_WRITE;
+	job.fd    = fd;
+	job.buf   = (void *) buf;
+	job.count = count;
+	return file_wait(&job);
+}
+
+ssize_t fiber_file_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	FILE_JOB job;
+
+	job.op     = FILE_WRITEV;
+	job.fd     = fd;
+	job.iov    = iov;
+	job.iovcnt = iovcnt;
+	return file_wait(&job);
+}
+
+ssize_t fiber_file_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	FILE_JOB job;
+
+	job.op     = FILE_PWRITE;
+	job.fd     = fd;
+	job.buf    = (void *) buf;
+	job.count  = count;
+	job.offset = offset;
+	return file_wait(&job);
+}
+
+int fiber_file_fsync(int fd)
+{
+	FILE_JOB job;
+
+	job.op = FILE_FSYNC;
+	job.fd = fd;
+	return (int) file_wait(&job);
+}
+
+int fiber_file_fdatasync(int fd)
+{
+	FILE_JOB job;
+
+	job.op = FILE_FDATASYNC;
+	job.fd = fd;
+	return (int) file_wait(&job);
+}
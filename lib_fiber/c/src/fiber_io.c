@@ -1,41 +1,148 @@
 #include "stdafx.h"
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include "fiber/lib_fiber.h"
 #include "event.h"
+#include "event_io_uring.h"
 #include "fiber.h"
 
 typedef struct {
 	EVENT      *event;
 	size_t      io_count;
 	ACL_FIBER  *ev_fiber;
-	ACL_RING    ev_timer;
+	ACL_FIBER **timers;	/* min-heap of the sleeping fibers, from 1 */
+	unsigned    ntimer;
+	unsigned    mtimer;
+	acl_int64   stamp;	/* the cached clock in milliseconds */
 	int         nsleeping;
 	int         io_stop;
+	int         wakefd;	/* for being waked up in M:N mode */
+	volatile int idle;
+	int         notifyfd;	/* for the waiters waked up by other threads */
+	acl_pthread_mutex_t wlock;
+	ACL_RING    waked;	/* the waiters waked up by other threads */
+	unsigned long long nloop;	/* the times waiting for events */
+	long long   idle_ns;	/* the time waiting for events if profiling */
 } FIBER_TLS;
 
 static FIBER_TLS *__main_fiber = NULL;
 static __thread FIBER_TLS *__thread_fiber = NULL;
 
+/* the threads scheduling the fibers in M:N mode, the idle ones wait for
+ * IO and may be waked up by the others to steal their ready fibers.
+ */
+static FIBER_TLS **__mn_threads = NULL;
+static int __mn_nthreads = 0;
+static volatile int __mn_nidle = 0;
+static volatile int __mn_stop  = 0;
+
 static void fiber_io_loop(ACL_FIBER *fiber, void *ctx);
 
 #define MAXFD		1024
 #define STACK_SIZE	819200
 static int __maxfd    = 1024;
+static int __use_io_uring = 0;
+
+void acl_fiber_use_io_uring(int onoff)
+{
+	__use_io_uring = onoff;
+}
 
 void acl_fiber_schedule_stop(void)
 {
 	fiber_io_check();
-	__thread_fiber->io_stop = 1;
+	if (__thread_fiber->wakefd >= 0)
+		fiber_io_mn_stop();
+	else
+		__thread_fiber->io_stop = 1;
+}
+
+/* the monotonic clock is read from vdso without any syscall; define
+ * FIBER_CLOCK as CLOCK_MONOTONIC_COARSE to make it even cheaper, but its
+ * precision is only one jiffy (4ms usually), too coarse for short sleeps.
+ */
+#ifndef	FIBER_CLOCK
+# define FIBER_CLOCK	CLOCK_MONOTONIC
+#endif
+
+#define SET_TIME(x) do {  \
+	struct timespec _ts;  \
+	clock_gettime(FIBER_CLOCK, &_ts);  \
+	(x) = ((acl_int64) _ts.tv_sec) * 1000 + _ts.tv_nsec / 1000000;  \
+} while (0)
+
+#define FIRST_TIMER() \
+	(__thread_fiber->ntimer > 0 ? __thread_fiber->timers[1] : NULL)
+
+static void timer_set(unsigned pos, ACL_FIBER *fiber)
+{
+	__thread_fiber->timers[pos] = fiber;
+	fiber->tindex = pos;
+}
+
+/* move the fiber at pos up or down to keep the heap ordered by when */
+static void timer_fix(unsigned pos)
+{
+	ACL_FIBER **timers = __thread_fiber->timers, *fiber = timers[pos];
+	unsigned child;
+
+	while (pos > 1 && timers[pos >> 1]->when > fiber->when) {
+		timer_set(pos, timers[pos >> 1]);
+		pos >>= 1;
+	}
+
+	while ((child = pos << 1) <= __thread_fiber->ntimer) {
+		if (child < __thread_fiber->ntimer
+			&& timers[child + 1]->when < timers[child]->when) {
+
+			child++;
+		}
+
+		if (timers[child]->when >= fiber->when)
+			break;
+
+		timer_set(pos, timers[child]);
+		pos = child;
+	}
+
+	timer_set(pos, fiber);
+}
+
+static void timer_add(ACL_FIBER *fiber)
+{
+	if (++__thread_fiber->ntimer >= __thread_fiber->mtimer) {
+		__thread_fiber->mtimer = __thread_fiber->mtimer > 0 ?
+			__thread_fiber->mtimer * 2 : 1024;
+		__thread_fiber->timers = (ACL_FIBER **) acl_myrealloc(
+			__thread_fiber->timers,
+			__thread_fiber->mtimer * sizeof(ACL_FIBER *));
+	}
+
+	timer_set(__thread_fiber->ntimer, fiber);
+	timer_fix(__thread_fiber->ntimer);
+
+	if (!fiber->sys && __thread_fiber->nsleeping++ == 0)
+		fiber_count_inc();
 }
 
-#define RING_TO_FIBER(r) \
-	((ACL_FIBER *) ((char *) (r) - offsetof(ACL_FIBER, me)))
+void fiber_io_timer_del(ACL_FIBER *fiber)
+{
+	unsigned pos = fiber->tindex;
+	ACL_FIBER *last;
+
+	if (pos == 0 || __thread_fiber == NULL)
+		return;
 
-#define FIRST_FIBER(head) \
-	(acl_ring_succ(head) != (head) ? RING_TO_FIBER(acl_ring_succ(head)) : 0)
+	fiber->tindex = 0;
+	last = __thread_fiber->timers[__thread_fiber->ntimer--];
 
-#define SET_TIME(x) {  \
-	gettimeofday(&tv, NULL);  \
-	(x) = tv.tv_sec * 1000 + tv.tv_usec / 1000; \
+	if (last != fiber) {
+		timer_set(pos, last);
+		timer_fix(pos);
+	}
+
+	if (!fiber->sys && --__thread_fiber->nsleeping == 0)
+		fiber_count_dec();
 }
 
 static acl_pthread_key_t __fiber_key;
@@ -52,6 +159,11 @@ static void thread_free(void *ctx)
 		tf->event = NULL;
 	}
 
+	if (tf->timers)
+		acl_myfree(tf->timers);
+	if (tf->notifyfd >= 0)
+		close(tf->notifyfd);
+	acl_pthread_mutex_destroy(&tf->wlock);
 	acl_myfree(tf);
 
 	if (__main_fiber == __thread_fiber)
@@ -92,13 +204,26 @@ void fiber_io_check(void)
 		__maxfd = MAXFD;
 
 	__thread_fiber = (FIBER_TLS *) acl_mymalloc(sizeof(FIBER_TLS));
-	__thread_fiber->event = event_create(__maxfd);
+	__thread_fiber->event = event_create(__maxfd,
+			__use_io_uring ? EVENT_F_IO_URING : 0);
 	__thread_fiber->ev_fiber = acl_fiber_create(fiber_io_loop,
 			__thread_fiber->event, STACK_SIZE);
+	/* it isn't a system fiber until running, don't let it be stolen */
+	__thread_fiber->ev_fiber->flag |= FIBER_F_PINNED;
 	__thread_fiber->io_count = 0;
+	__thread_fiber->timers = NULL;
+	__thread_fiber->ntimer = 0;
+	__thread_fiber->mtimer = 0;
 	__thread_fiber->nsleeping = 0;
 	__thread_fiber->io_stop = 0;
-	acl_ring_init(&__thread_fiber->ev_timer);
+	__thread_fiber->wakefd = -1;
+	__thread_fiber->idle = 0;
+	__thread_fiber->notifyfd = -1;
+	__thread_fiber->nloop = 0;
+	__thread_fiber->idle_ns = 0;
+	acl_pthread_mutex_init(&__thread_fiber->wlock, NULL);
+	acl_ring_init(&__thread_fiber->waked);
+	SET_TIME(__thread_fiber->stamp);
 
 	if ((unsigned long) acl_pthread_self() == acl_main_thread_self()) {
 		__main_fiber = __thread_fiber;
@@ -127,59 +252,291 @@ EVENT *fiber_io_event(void)
 
 void fiber_io_close(int fd)
 {
-	if (__thread_fiber != NULL)
-		event_del(__thread_fiber->event, fd, EVENT_ERROR);
+	if (__thread_fiber == NULL)
+		return;
+
+	event_del(__thread_fiber->event, fd, EVENT_ERROR);
+
+#ifdef	HAS_IO_URING
+	if (__thread_fiber->event->flag & EVENT_F_IO_URING)
+		event_uring_close(__thread_fiber->event, fd);
+#endif
+}
+
+void fiber_io_mn_init(int nthreads)
+{
+	__mn_threads  = (FIBER_TLS **)
+		acl_mycalloc(nthreads, sizeof(FIBER_TLS *));
+	__mn_nthreads = nthreads;
+	__mn_nidle    = 0;
+	__mn_stop     = 0;
+}
+
+/* the eventfd is read and written by syscall directly, because the hooked
+ * API may submit them to io_uring and wait.
+ */
+static void mn_notify(int fd)
+{
+	acl_uint64 n = 1;
+
+	if (syscall(SYS_write, fd, &n, sizeof(n)) < 0)
+		fiber_save_errno();
+}
+
+static void mn_wakeup_callback(EVENT *ev acl_unused, int fd,
+	void *ctx acl_unused, int mask acl_unused)
+{
+	acl_uint64 n;
+
+	if (syscall(SYS_read, fd, &n, sizeof(n)) < 0)
+		fiber_save_errno();
+}
+
+void fiber_io_mn_join(int index)
+{
+	fiber_io_check();
+
+	__thread_fiber->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (__thread_fiber->wakefd < 0)
+		acl_msg_fatal("%s(%d), %s: eventfd error %s",
+			__FILE__, __LINE__, __FUNCTION__, acl_last_serror());
+
+	/* the eventfd isn't a socket, but it can be polled */
+	__thread_fiber->event->events[__thread_fiber->wakefd].type = TYPE_SOCK;
+
+	if (event_add(__thread_fiber->event, __thread_fiber->wakefd,
+		EVENT_READABLE, mn_wakeup_callback, NULL) <= 0) {
+
+		acl_msg_fatal("%s(%d), %s: add eventfd %d error %s",
+			__FILE__, __LINE__, __FUNCTION__,
+			__thread_fiber->wakefd, acl_last_serror());
+	}
+
+	__mn_threads[index] = __thread_fiber;
+
+	/* maybe all the fibers have exited before the thread starting */
+	__sync_synchronize();
+	if (__mn_stop)
+		__thread_fiber->io_stop = 1;
+}
+
+void fiber_io_mn_leave(void)
+{
+	event_del_nodelay(__thread_fiber->event, __thread_fiber->wakefd,
+		EVENT_READABLE);
+	close(__thread_fiber->wakefd);
+	__thread_fiber->wakefd = -1;
+}
+
+void fiber_io_mn_end(void)
+{
+	acl_myfree(__mn_threads);
+	__mn_threads  = NULL;
+	__mn_nthreads = 0;
+}
+
+/* wake up one of the idle threads to steal the ready fibers */
+void fiber_io_mn_wakeup(void)
+{
+	FIBER_TLS *tf;
+	int i;
+
+	__sync_synchronize();
+	if (__mn_nidle == 0)
+		return;
+
+	for (i = 0; i < __mn_nthreads; i++) {
+		tf = __mn_threads[i];
+		if (tf != NULL && tf->idle
+			&& __sync_bool_compare_and_swap(&tf->idle, 1, 0)) {
+
+			mn_notify(tf->wakefd);
+			break;
+		}
+	}
+}
+
+void fiber_io_mn_stop(void)
+{
+	FIBER_TLS *tf;
+	int i;
+
+	__mn_stop = 1;
+	__sync_synchronize();
+
+	for (i = 0; i < __mn_nthreads; i++) {
+		if ((tf = __mn_threads[i]) != NULL) {
+			tf->io_stop = 1;
+			mn_notify(tf->wakefd);
+		}
+	}
+}
+
+#define	RING_TO_WAITER(r) \
+	((FIBER_WAITER *) ((char *) (r) - offsetof(FIBER_WAITER, me)))
+
+static void waked_callback(EVENT *ev acl_unused, int fd,
+	void *ctx acl_unused, int mask acl_unused)
+{
+	FIBER_WAITER *waiter;
+	ACL_RING *r;
+	acl_uint64 n;
+
+	if (syscall(SYS_read, fd, &n, sizeof(n)) < 0)
+		fiber_save_errno();
+
+	acl_pthread_mutex_lock(&__thread_fiber->wlock);
+	while ((r = acl_ring_pop_head(&__thread_fiber->waked)) != NULL) {
+		waiter = RING_TO_WAITER(r);
+		waiter->waked = 1;
+		acl_fiber_ready(waiter->fiber);
+		__thread_fiber->io_count--;
+	}
+	acl_pthread_mutex_unlock(&__thread_fiber->wlock);
+}
+
+/* prepare the running fiber for waiting to be waked up by other threads,
+ * the eventfd of the thread is created at the first time.
+ */
+void fiber_io_waiter(FIBER_WAITER *waiter)
+{
+	waiter->fiber = acl_fiber_running();
+	waiter->tls   = NULL;
+	waiter->waked = 0;
+
+	if (waiter->fiber == NULL)
+		return;
+
+	fiber_io_check();
+	waiter->tls = __thread_fiber;
+
+	if (__thread_fiber->notifyfd >= 0)
+		return;
+
+	__thread_fiber->notifyfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (__thread_fiber->notifyfd < 0)
+		acl_msg_fatal("%s(%d), %s: eventfd error %s",
+			__FILE__, __LINE__, __FUNCTION__, acl_last_serror());
+
+	__thread_fiber->event->events[__thread_fiber->notifyfd].type = TYPE_SOCK;
+
+	if (event_add(__thread_fiber->event, __thread_fiber->notifyfd,
+		EVENT_READABLE, waked_callback, NULL) <= 0) {
+
+		acl_msg_fatal("%s(%d), %s: add eventfd %d error %s",
+			__FILE__, __LINE__, __FUNCTION__,
+			__thread_fiber->notifyfd, acl_last_serror());
+	}
+}
+
+/* wake up the fiber waiting, which may be in another thread: the waiter is
+ * put into the list of its thread, and the eventfd is written only when
+ * the list was empty, so the thread is notified once for many waiters;
+ * it's written with the lock held for the thread may exit at once after
+ * the waiter being waked up.
+ */
+void fiber_io_wakeup(FIBER_WAITER *waiter)
+{
+	FIBER_TLS *tf = (FIBER_TLS *) waiter->tls;
+	int empty;
+
+	if (tf == __thread_fiber) {
+		waiter->waked = 1;
+		acl_fiber_ready(waiter->fiber);
+		tf->io_count--;
+		return;
+	}
+
+	acl_pthread_mutex_lock(&tf->wlock);
+	empty = acl_ring_size(&tf->waked) == 0;
+	acl_ring_append(&tf->waked, &waiter->me);
+	if (empty)
+		mn_notify(tf->notifyfd);
+	acl_pthread_mutex_unlock(&tf->wlock);
+}
+
+/* the thread tries to steal some ready fibers from the others before
+ * waiting for IO, and it may be waked up when the others have more fibers
+ * ready while waiting.
+ */
+static void mn_process(EVENT *ev, int left)
+{
+	if (left == 0 || fiber_mn_steal() > 0) {
+		event_process(ev, 0);
+		return;
+	}
+
+	__thread_fiber->idle = 1;
+	__sync_add_and_fetch(&__mn_nidle, 1);
+
+	/* check again for the fibers ready before being idle */
+	if (fiber_mn_steal() > 0)
+		left = 0;
+
+	event_process(ev, left);
+
+	__thread_fiber->idle = 0;
+	__sync_sub_and_fetch(&__mn_nidle, 1);
 }
 
 static void fiber_io_loop(ACL_FIBER *self acl_unused, void *ctx)
 {
 	EVENT *ev = (EVENT *) ctx;
-	int left;
 	ACL_FIBER *timer;
-	int now, last = 0;
-	struct timeval tv;
+	acl_int64 left;
+	int nwaked;
 
 	fiber_system();
 
 	for (;;) {
 		while (acl_fiber_yield() > 0) {}
 
-		timer = FIRST_FIBER(&__thread_fiber->ev_timer);
-		if (timer == NULL)
-			left = -1;
-		else {
-			SET_TIME(now);
-			last = now;
-			if (now >= timer->when)
-				left = 0;
-			else
-				left = timer->when - now;
-		}
+		/* the clock is read only once in each loop, the fibers
+		 * calling acl_fiber_delay will update it too.
+		 */
+		SET_TIME(__thread_fiber->stamp);
 
-		/* add 1 just for the deviation of epoll_wait */
-		event_process(ev, left > 0 ? left + 1 : left);
+		nwaked = 0;
+		while ((timer = FIRST_TIMER()) != NULL
+			&& timer->when <= __thread_fiber->stamp) {
 
-		if (__thread_fiber->io_stop)
-			break;
-
-		if (timer == NULL)
-			continue;
-
-		SET_TIME(now);
+			fiber_io_timer_del(timer);
+			acl_fiber_ready(timer);
+			nwaked++;
+		}
 
-		if (now - last < left)
-			continue;
+		if (nwaked > 0) {
+			/* run the waked up fibers before waiting for IO */
+			left = 0;
+		} else if (timer == NULL)
+			left = -1;
+		else {
+			left = timer->when - __thread_fiber->stamp;
+			if (left > 1000)
+				left = 1000;
+			else  /* add 1 just for the deviation of epoll_wait */
+				left++;
+		}
 
-		do {
-			acl_ring_detach(&timer->me);
+		if (fiber_profile_on) {
+			long long begin, end;
 
-			if (!timer->sys && --__thread_fiber->nsleeping == 0)
-				fiber_count_dec();
+			FIBER_NS(begin);
+			if (__thread_fiber->wakefd >= 0)
+				mn_process(ev, (int) left);
+			else
+				event_process(ev, (int) left);
+			FIBER_NS(end);
+			__thread_fiber->idle_ns += end - begin;
+		} else if (__thread_fiber->wakefd >= 0)
+			mn_process(ev, (int) left);
+		else
+			event_process(ev, (int) left);
 
-			acl_fiber_ready(timer);
-			timer = FIRST_FIBER(&__thread_fiber->ev_timer);
+		__thread_fiber->nloop++;
 
-		} while (timer != NULL && now >= timer->when);
+		if (__thread_fiber->io_stop)
+			break;
 	}
 
 	if (__thread_fiber->io_count > 0)
@@ -187,18 +544,20 @@ static void fiber_io_loop(ACL_FIBER *self acl_unused, void *ctx)
 			__FUNCTION__, (int) __thread_fiber->io_count);
 }
 
-#define CHECK_MIN
+/* the fiber may be resumed in another thread in M:N mode, so the cached
+ * clock must be read in a function not inlined after switching.
+ */
+static acl_int64 fiber_io_stamp(void) __attribute__ ((noinline));
+
+static acl_int64 fiber_io_stamp(void)
+{
+	return __thread_fiber->stamp;
+}
 
 unsigned int acl_fiber_delay(unsigned int milliseconds)
 {
 	acl_int64 when, now;
-	struct timeval tv;
 	ACL_FIBER *fiber;
-	ACL_RING_ITER iter;
-	EVENT *ev;
-#ifdef	CHECK_MIN
-	acl_int64 min = -1;
-#endif
 
 	if (!acl_var_hook_sys_api) {
 		acl_doze(milliseconds);
@@ -207,49 +566,25 @@ unsigned int acl_fiber_delay(unsigned int milliseconds)
 
 	fiber_io_check();
 
-	ev = fiber_io_event();
-
-	SET_TIME(when);
-	when += milliseconds;
-
-	acl_ring_foreach_reverse(iter, &__thread_fiber->ev_timer) {
-		fiber = acl_ring_to_appl(iter.ptr, ACL_FIBER, me);
-		if (when >= fiber->when) {
-#ifdef	CHECK_MIN
-			acl_int64 n = when - fiber->when;
-			if (min == -1 || n < min)
-				min = n;
-#endif
-			break;
-		}
-	}
-
-#ifdef	CHECK_MIN
-	if ((min >= 0 && min < ev->timeout) || ev->timeout < 0)
-		ev->timeout = (int) min;
-#else
-	ev->timeout = 10;
-#endif
+	SET_TIME(now);
+	__thread_fiber->stamp = now;
+	when = now + milliseconds;
 
 	fiber = acl_fiber_running();
 	fiber->when = when;
 	acl_ring_detach(&fiber->me);
 
-	acl_ring_append(iter.ptr, &fiber->me);
+	timer_add(fiber);
 
-	if (!fiber->sys && __thread_fiber->nsleeping++ == 0)
-		fiber_count_inc();
-
-	acl_fiber_switch();
+	fiber->nwait_timer++;
+	FIBER_WAIT(fiber->timer_ns);
 
-	//acl_ring_detach(&fiber->me);
-
-	if (acl_ring_size(&__thread_fiber->ev_timer) == 0)
-		ev->timeout = -1;
-	else
-		ev->timeout = min;
+	/* be sure the fiber was removed from the timers, maybe it was waked
+	 * up by others before the timer arrived.
+	 */
+	fiber_io_timer_del(fiber);
 
-	SET_TIME(now);
+	now = fiber_io_stamp();
 	if (now < when)
 		return 0;
 
@@ -258,7 +593,6 @@ unsigned int acl_fiber_delay(unsigned int milliseconds)
 
 static void fiber_timer_callback(ACL_FIBER *fiber, void *ctx)
 {
-	struct timeval tv;
 	acl_int64 now, left;
 
 	SET_TIME(now);
@@ -283,7 +617,6 @@ ACL_FIBER *acl_fiber_create_timer(unsigned int milliseconds, size_t size,
 	void (*fn)(ACL_FIBER *, void *), void *ctx)
 {
 	acl_int64 when;
-	struct timeval tv;
 	ACL_FIBER *fiber;
 
 	fiber_io_check();
@@ -300,7 +633,6 @@ ACL_FIBER *acl_fiber_create_timer(unsigned int milliseconds, size_t size,
 void acl_fiber_reset_timer(ACL_FIBER *fiber, unsigned int milliseconds)
 {
 	acl_int64 when;
-	struct timeval tv;
 
 	fiber_io_check();
 
@@ -308,6 +640,10 @@ void acl_fiber_reset_timer(ACL_FIBER *fiber, unsigned int milliseconds)
 	when += milliseconds;
 	fiber->when = when;
 	fiber->status = FIBER_STATUS_READY;
+
+	/* reorder the timer fiber if it's sleeping now */
+	if (fiber->tindex > 0)
+		timer_fix(fiber->tindex);
 }
 
 unsigned int acl_fiber_sleep(unsigned int seconds)
@@ -319,7 +655,13 @@ static void read_callback(EVENT *ev, int fd, void *ctx, int mask)
 {
 	ACL_FIBER *me = (ACL_FIBER *) ctx;
 
-	event_del(ev, fd, mask);
+	/* the fiber may close the fd in another thread in M:N mode, so the
+	 * fd shouldn't be left in the event of this thread.
+	 */
+	if (__thread_fiber->wakefd >= 0)
+		event_del_nodelay(ev, fd, mask);
+	else
+		event_del(ev, fd, mask);
 	acl_fiber_ready(me);
 
 	__thread_fiber->io_count--;
@@ -343,14 +685,18 @@ void fiber_wait_read(int fd)
 
 	__thread_fiber->io_count++;
 
-	acl_fiber_switch();
+	me->nwait_io++;
+	FIBER_WAIT(me->io_ns);
 }
 
 static void write_callback(EVENT *ev, int fd, void *ctx, int mask)
 {
 	ACL_FIBER *me = (ACL_FIBER *) ctx;
 
-	event_del(ev, fd, mask);
+	if (__thread_fiber->wakefd >= 0)
+		event_del_nodelay(ev, fd, mask);
+	else
+		event_del(ev, fd, mask);
 	acl_fiber_ready(me);
 
 	__thread_fiber->io_count--;
@@ -372,7 +718,19 @@ void fiber_wait_write(int fd)
 
 	__thread_fiber->io_count++;
 
-	acl_fiber_switch();
+	me->nwait_io++;
+	FIBER_WAIT(me->io_ns);
+}
+
+void fiber_io_stat(ACL_FIBER_SCHED_STAT *stat)
+{
+	if (__thread_fiber == NULL)
+		return;
+
+	stat->nwait_io  = (int) __thread_fiber->io_count;
+	stat->nsleeping = (int) __thread_fiber->ntimer;
+	stat->nloop     = __thread_fiber->nloop;
+	stat->idle_ns   = __thread_fiber->idle_ns;
 }
 
 void fiber_io_fibers_free()
@@ -0,0 +1,282 @@
+#include "stdafx.h"
+#include <sys/mman.h>
+#include "fiber/lib_fiber.h"
+#include "fiber.h"
+
+/* The stacks of the fibers are carved from the chunks mapped by mmap, with
+ * a PROT_NONE guard page below each of them, so a stack overflow crashes
+ * at once instead of corrupting the memory of others silently. The stacks
+ * freed are kept in a pool shared by all the threads, grouped in the size
+ * classes of power of two, and never unmapped; the pages of the stacks
+ * idle in the pool for a while, or more than the pool keeps, are given
+ * back to the kernel with MADV_DONTNEED.
+ *
+ * Each guard page splits the mapping, so only a part of vm.max_map_count
+ * is used for them, and the stacks allocated after that have no guard.
+ */
+
+#define	STACK_MIN_SHIFT	13		/* the smallest class: 8KB */
+#define	STACK_NCLASS	18		/* the largest class: 1GB */
+#define	STACK_CHUNK	(1024 * 1024)	/* the chunk size mapped at least */
+#define	STACK_NCHUNK	64		/* the max stacks in one chunk */
+
+typedef struct {
+	char   *addr;
+	time_t  stamp;		/* when being put into the pool */
+} STACK_ITEM;
+
+/* the stacks of one size class, the newest is the last one, and the first
+ * nadvised ones have been given back.
+ */
+typedef struct {
+	acl_pthread_mutex_t lock;
+	STACK_ITEM *items;
+	int         count;
+	int         size;
+	int         nadvised;
+} STACK_CLASS;
+
+static STACK_CLASS __classes[STACK_NCLASS];
+static size_t __page_size   = 4096;
+static int    __stack_max   = 1000;
+static int    __stack_idle  = 10;
+static int    __stack_guard = 1;
+static int    __guard_left  = 65530 / 4;
+static time_t __last_trim   = 0;
+
+static void stack_init(void) __attribute__ ((constructor));
+
+static void stack_init(void)
+{
+	long n = sysconf(_SC_PAGESIZE);
+	FILE *fp;
+	int  i;
+
+	if (n > 0)
+		__page_size = (size_t) n;
+
+	fp = fopen("/proc/sys/vm/max_map_count", "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%d", &i) == 1 && i > 0)
+			__guard_left = i / 4;
+		fclose(fp);
+	}
+
+	for (i = 0; i < STACK_NCLASS; i++)
+		acl_pthread_mutex_init(&__classes[i].lock, NULL);
+}
+
+void acl_fiber_stack_pool(int max, int idle)
+{
+	__stack_max  = max >= 0 ? max : 0;
+	__stack_idle = idle >= 0 ? idle : 0;
+}
+
+void acl_fiber_stack_guard(int onoff)
+{
+	__stack_guard = onoff;
+}
+
+/* get the size class of the stack, and round the size up to it */
+static int stack_class(size_t *size)
+{
+	size_t n = (size_t) 1 << STACK_MIN_SHIFT;
+	int i;
+
+	for (i = 0; i < STACK_NCLASS; i++, n <<= 1) {
+		if (*size <= n) {
+			*size = n;
+			return i;
+		}
+	}
+
+	/* too large to be pooled, just round up to the pages */
+	*size = (*size + __page_size - 1) & ~(__page_size - 1);
+	return -1;
+}
+
+#define	CLASS_SIZE(sc)	((size_t) 1 << (STACK_MIN_SHIFT + ((sc) - __classes)))
+
+static void stack_advise(STACK_CLASS *sc, STACK_ITEM *item)
+{
+	(void) madvise(item->addr, CLASS_SIZE(sc), MADV_DONTNEED);
+}
+
+static void stack_trim(STACK_CLASS *sc, time_t expire)
+{
+	while (sc->nadvised < sc->count
+		&& sc->items[sc->nadvised].stamp <= expire) {
+
+		stack_advise(sc, &sc->items[sc->nadvised++]);
+	}
+}
+
+/* give back the pages of the stacks idle too long, at most once a second */
+static void stack_check(time_t now)
+{
+	int i;
+
+	if (now == __last_trim)
+		return;
+	__last_trim = now;
+
+	for (i = 0; i < STACK_NCLASS; i++) {
+		STACK_CLASS *sc = &__classes[i];
+
+		if (sc->nadvised == sc->count)
+			continue;
+
+		acl_pthread_mutex_lock(&sc->lock);
+		stack_trim(sc, now - __stack_idle);
+		acl_pthread_mutex_unlock(&sc->lock);
+	}
+}
+
+static void stack_guard(char *ptr)
+{
+	static int __warned = 0;
+
+	if (!__stack_guard || __guard_left <= 0)
+		return;
+
+	if (mprotect(ptr, __page_size, PROT_NONE) == 0) {
+		__sync_sub_and_fetch(&__guard_left, 1);
+		return;
+	}
+
+	if (!__warned) {
+		__warned = 1;
+		acl_msg_warn("%s(%d), %s: mprotect error %s, no guard page "
+			"for the stacks from now on", __FILE__, __LINE__,
+			__FUNCTION__, acl_last_serror());
+	}
+	__guard_left = 0;
+}
+
+static char *stack_map(size_t len)
+{
+	char *ptr = (char *) mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (ptr == MAP_FAILED)
+		acl_msg_fatal("%s(%d), %s: mmap %lu error %s", __FILE__,
+			__LINE__, __FUNCTION__, (unsigned long) len,
+			acl_last_serror());
+	return ptr;
+}
+
+/* map a chunk of stacks, one of them is returned and the others are put
+ * into the pool, the lock of sc has been held.
+ */
+static char *stack_chunk(STACK_CLASS *sc, time_t now)
+{
+	size_t size = CLASS_SIZE(sc) + __page_size;
+	int    i, n = (int) (STACK_CHUNK / size);
+	char  *ptr;
+
+	if (n < 1)
+		n = 1;
+	else if (n > STACK_NCHUNK)
+		n = STACK_NCHUNK;
+
+	if (sc->count + n > sc->size) {
+		sc->size  = sc->count + n > sc->size * 2 ?
+			sc->count + n : sc->size * 2;
+		sc->items = (STACK_ITEM *) acl_myrealloc(sc->items,
+			sc->size * sizeof(STACK_ITEM));
+	}
+
+	ptr = stack_map(size * n);
+
+	/* the pages never used needn't be advised, so they're put before
+	 * the stacks not advised
+	 */
+	if (sc->nadvised < sc->count)
+		memmove(&sc->items[sc->nadvised + n - 1],
+			&sc->items[sc->nadvised],
+			(sc->count - sc->nadvised) * sizeof(STACK_ITEM));
+
+	for (i = 0; i < n; i++, ptr += size) {
+		stack_guard(ptr);
+		if (i == n - 1)
+			break;
+		sc->items[sc->nadvised].addr  = ptr + __page_size;
+		sc->items[sc->nadvised].stamp = now;
+		sc->nadvised++;
+		sc->count++;
+	}
+
+	return ptr + __page_size;
+}
+
+char *fiber_stack_alloc(size_t *size)
+{
+	STACK_CLASS *sc;
+	char  *ptr;
+	time_t now;
+	int    i = stack_class(size);
+
+	if (i < 0) {
+		ptr = stack_map(*size + __page_size);
+		stack_guard(ptr);
+		return ptr + __page_size;
+	}
+
+	sc  = &__classes[i];
+	now = time(NULL);
+
+	acl_pthread_mutex_lock(&sc->lock);
+	if (sc->count > 0) {
+		ptr = sc->items[--sc->count].addr;
+		if (sc->nadvised > sc->count)
+			sc->nadvised = sc->count;
+	} else
+		ptr = stack_chunk(sc, now);
+	acl_pthread_mutex_unlock(&sc->lock);
+
+	stack_check(now);
+	return ptr;
+}
+
+void fiber_stack_free(char *stack, size_t size)
+{
+	STACK_CLASS *sc;
+	STACK_ITEM  *item;
+	time_t now;
+	int    i = stack_class(&size);
+
+	if (i < 0) {
+		munmap(stack - __page_size, size + __page_size);
+		return;
+	}
+
+	sc  = &__classes[i];
+	now = time(NULL);
+
+	acl_pthread_mutex_lock(&sc->lock);
+
+	if (sc->count == sc->size) {
+		sc->size  = sc->size > 0 ? sc->size * 2 : 64;
+		sc->items = (STACK_ITEM *) acl_myrealloc(sc->items,
+			sc->size * sizeof(STACK_ITEM));
+	}
+
+	item = &sc->items[sc->count++];
+	item->addr  = stack;
+	item->stamp = now;
+
+	/* more stacks than the pool keeps are given back at once, and moved
+	 * to the advised ones
+	 */
+	if (sc->count - sc->nadvised > __stack_max) {
+		STACK_ITEM tmp = *item;
+
+		*item = sc->items[sc->nadvised];
+		sc->items[sc->nadvised] = tmp;
+		stack_advise(sc, &sc->items[sc->nadvised++]);
+	}
+
+	acl_pthread_mutex_unlock(&sc->lock);
+
+	stack_check(now);
+}
@@ -0,0 +1,322 @@
+#include "stdafx.h"
+#include <limits.h>
+#include "fiber/lib_fiber.h"
+#include "event.h"
+#include "event_io_uring.h"
+#include "fiber.h"
+
+#ifdef	HAS_IO_URING
+
+/* When the io_uring event engine is used, the hooked IO API submit the
+ * completion based requests instead of waiting for the readiness first;
+ * all the requests are submitted in one syscall by the event loop, and
+ * the fiber is waked up with the result when the request completes.
+ */
+
+#define	URING_LEN(n)	((unsigned) ((n) > INT_MAX ? INT_MAX : (n)))
+
+static void uring_callback(EVENT *ev acl_unused, IO_URING_REQ *req)
+{
+	acl_fiber_ready(req->fiber);
+	fiber_io_dec();
+}
+
+/* the regular files are read and written by io_uring too, which are never
+ * blocked by the disk; the kernel fills the buffers after the fiber switched
+ * out, which may be on the shared stack being used by another fiber, so the
+ * fibers using the shared stack wait for the readiness instead.
+ */
+int fiber_io_uring(int fd)
+{
+	EVENT *ev = fiber_io_event();
+	ACL_FIBER *me = acl_fiber_running();
+
+	return (ev->flag & EVENT_F_IO_URING)
+		&& (event_checkfd(ev, fd) || event_isfile(ev, fd))
+		&& (me == NULL || !(me->flag & FIBER_F_SHARED));
+}
+
+/* wait for the request's completion, and return the result or -errno */
+static int uring_wait(EVENT *ev, IO_URING_REQ *req, int mask)
+{
+	ACL_FIBER *me = acl_fiber_running();
+	int fd = req->fd, res;
+
+	req->fiber = me;
+	req->proc  = uring_callback;
+
+	fiber_io_inc();
+	acl_fiber_switch();
+
+	/* the fiber signaled isn't stolen by others in M:N mode, so it's
+	 * still in the thread of ev here
+	 */
+	if (req->status != URING_DONE) {
+		/* waked up by acl_fiber_kill or acl_fiber_signal */
+		fiber_io_dec();
+		event_uring_cancel(ev, req);
+		acl_msg_info("%s(%d), %s: fiber-%u was killed",
+			__FILE__, __LINE__, __FUNCTION__, acl_fiber_id(me));
+		return -EINTR;
+	}
+
+	res = req->res;
+	ev  = fiber_io_event();
+	if (ev->flag & EVENT_F_IO_URING)
+		event_uring_free(ev, req);
+	else
+		acl_myfree(req);
+
+	/* the fd can't be polled by io_uring in some kernels, so wait for
+	 * its readiness and let the caller try again
+	 */
+	if (res == -EAGAIN && mask != EVENT_NONE) {
+		if (mask & EVENT_READABLE)
+			fiber_wait_read(fd);
+		else
+			fiber_wait_write(fd);
+
+		if (acl_fiber_killed(me))
+			return -EINTR;
+	}
+
+	return res;
+}
+
+static ssize_t uring_result(int res)
+{
+	if (res >= 0)
+		return res;
+
+	/* the errno is the running fiber's errnum for being hooked */
+	errno = -res;
+	return -1;
+}
+
+/* the event is got again for each request, because the fiber may be
+ * resumed in another thread when trying again in M:N mode
+ */
+#define	URING_REQ(ev, req, op, fd) do {  \
+	(ev) = fiber_io_event();  \
+	if (((req) = event_uring_req((ev), (op), (fd))) == NULL)  \
+		return uring_result(-EBUSY);  \
+} while (0)
+
+#define	URING_WAIT(ev, req, mask, res)  \
+	(((res) = uring_wait((ev), (req), (mask))) == -EAGAIN  \
+	 && (mask) != EVENT_NONE)
+
+ssize_t fiber_uring_read(int fd, void *buf, size_t count)
+{
+	EVENT *ev;
+	IO_URING_REQ *req;
+	int res;
+
+	do {
+		URING_REQ(ev, req, IORING_OP_READ, fd);
+		req->sqe->addr = (unsigned long) buf;
+		req->sqe->len  = URING_LEN(count);
+		req->sqe->off  = (acl_uint64) -1;
+	} while (URING_WAIT(ev, req, EVENT_READABLE, res));
+
+	return uring_result(res);
+}
+
+ssize_t fiber_uring_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	EVENT *ev;
+	IO_URING_REQ *req;
+	int res;
+
+	do {
+		URING_REQ(ev, req, IORING_OP_READV, fd);
+		req->sqe->addr = (unsigned long) iov;
+		req->sqe->len  = (unsigned) iovcnt;
+		req->sqe->off  = (acl_uint64) -1;
+	} while (URING_WAIT(ev, req, EVENT_READABLE, res));
+
+	return uring_result(res);
+}
+
+ssize_t fiber_uring_recv(int sockfd, void *buf, size_t len, int flags)
+{
+	EVENT *ev;
+	IO_URING_REQ *req;
+	int res, mask = flags & MSG_DONTWAIT ? EVENT_NONE : EVENT_READABLE;
+
+	do {
+		URING_REQ(ev, req, IORING_OP_RECV, sockfd);
+		req->sqe->addr      = (unsigned long) buf;
+		req->sqe->len       = URING_LEN(len);
+		req->sqe->msg_flags = (unsigned) flags;
+	} while (URING_WAIT(ev, req, mask, res));
+
+	return uring_result(res);
+}
+
+ssize_t fiber_uring_recvmsg(int sockfd, struct msghdr *msg, int flags)
+{
+	EVENT *ev;
+	IO_URING_REQ *req;
+	int res, mask = flags & MSG_DONTWAIT ? EVENT_NONE : EVENT_READABLE;
+
+	do {
+		URING_REQ(ev, req, IORING_OP_RECVMSG, sockfd);
+		req->sqe->addr      = (unsigned long) msg;
+		req->sqe->len       = 1;
+		req->sqe->msg_flags = (unsigned) flags;
+	} while (URING_WAIT(ev, req, mask, res));
+
+	return uring_result(res);
+}
+
+ssize_t fiber_uring_recvfrom(int sockfd, void *buf, size_t len, int flags,
+	struct sockaddr *src_addr, socklen_t *addrlen)
+{
+	struct msghdr msg;
+	struct iovec  iov;
+	ssize_t ret;
+
+	if (src_addr == NULL || addrlen == NULL)
+		return fiber_uring_recv(sockfd, buf, len, flags);
+
+	iov.iov_base = buf;
+	iov.iov_len  = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name    = src_addr;
+	msg.msg_namelen = *addrlen;
+	msg.msg_iov     = &iov;
+	msg.msg_iovlen  = 1;
+
+	ret = fiber_uring_recvmsg(sockfd, &msg, flags);
+	if (ret >= 0)
+		*addrlen = msg.msg_namelen;
+	return ret;
+}
+
+ssize_t fiber_uring_write(int fd, const void *buf, size_t count)
+{
+	EVENT *ev;
+	IO_URING_REQ *req;
+	int res;
+
+	do {
+		URING_REQ(ev, req, IORING_OP_WRITE, fd);
+		req->sqe->addr = (unsigned long) buf;
+		req->sqe->len  = URING_LEN(count);
+		req->sqe->off  = (acl_uint64) -1;
+	} while (URING_WAIT(ev, req, EVENT_WRITABLE, res));
+
+	return uring_result(res);
+}
+
+ssize_t fiber_uring_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	EVENT *ev;
+	IO_URING_REQ *req;
+	int res;
+
+	do {
+		URING_REQ(ev, req, IORING_OP_WRITEV, fd);
+		req->sqe->addr = (unsigned long) iov;
+		req->sqe->len  = (unsigned) iovcnt;
+		req->sqe->off  = (acl_uint64) -1;
+	} while (URING_WAIT(ev, req, EVENT_WRITABLE, res));
+
+	return uring_result(res);
+}
+
+ssize_t fiber_uring_send(int sockfd, const void *buf, size_t len, int flags)
+{
+	EVENT *ev;
+	IO_URING_REQ *req;
+	int res, mask = flags & MSG_DONTWAIT ? EVENT_NONE : EVENT_WRITABLE;
+
+	do {
+		URING_REQ(ev, req, IORING_OP_SEND, sockfd);
+		req->sqe->addr      = (unsigned long) buf;
+		req->sqe->len       = URING_LEN(len);
+		req->sqe->msg_flags = (unsigned) flags;
+	} while (URING_WAIT(ev, req, mask, res));
+
+	return uring_result(res);
+}
+
+ssize_t fiber_uring_sendmsg(int sockfd, const struct msghdr *msg, int flags)
+{
+	EVENT *ev;
+	IO_URING_REQ *req;
+	int res, mask = flags & MSG_DONTWAIT ? EVENT_NONE : EVENT_WRITABLE;
+
+	do {
+		URING_REQ(ev, req, IORING_OP_SENDMSG, sockfd);
+		req->sqe->addr      = (unsigned long) msg;
+		req->sqe->len       = 1;
+		req->sqe->msg_flags = (unsigned) flags;
+	} while (URING_WAIT(ev, req, mask, res));
+
+	return uring_result(res);
+}
+
+ssize_t fiber_uring_sendto(int sockfd, const void *buf, size_t len, int flags,
+	const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+	struct msghdr msg;
+	struct iovec  iov;
+
+	if (dest_addr == NULL)
+		return fiber_uring_send(sockfd, buf, len, flags);
+
+	iov.iov_base = (void *) buf;
+	iov.iov_len  = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name    = (void *) dest_addr;
+	msg.msg_namelen = addrlen;
+	msg.msg_iov     = &iov;
+	msg.msg_iovlen  = 1;
+
+	return fiber_uring_sendmsg(sockfd, &msg, flags);
+}
+
+int fiber_uring_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	EVENT *ev;
+	IO_URING_REQ *req;
+	int res;
+
+	do {
+		URING_REQ(ev, req, IORING_OP_ACCEPT, sockfd);
+		req->sqe->addr         = (unsigned long) addr;
+		req->sqe->addr2        = (unsigned long) addrlen;
+		req->sqe->accept_flags = SOCK_NONBLOCK;
+	} while (URING_WAIT(ev, req, EVENT_READABLE, res));
+
+	if (res >= 0)
+		acl_tcp_nodelay(res, 1);
+
+	return (int) uring_result(res);
+}
+
+int fiber_uring_connect(int sockfd, const struct sockaddr *addr,
+	socklen_t addrlen)
+{
+	EVENT *ev;
+	IO_URING_REQ *req;
+	int res;
+
+	acl_non_blocking(sockfd, ACL_NON_BLOCKING);
+
+	URING_REQ(ev, req, IORING_OP_CONNECT, sockfd);
+	req->sqe->addr = (unsigned long) addr;
+	req->sqe->off  = addrlen;
+
+	res = uring_wait(ev, req, EVENT_NONE);
+	if (res == 0)
+		acl_tcp_nodelay(sockfd, 1);
+
+	return (int) uring_result(res);
+}
+
+#endif /* HAS_IO_URING */
@@ -24,6 +24,10 @@ typedef int     (*stat_fn)(int, const char*, struct stat*);
 typedef int     (*lstat_fn)(int, const char*, struct stat*);
 typedef int     (*fstat_fn)(int, int, struct stat*);
 typedef int     (*mkdir_fn)(const char*, mode_t);
+typedef int     (*open_fn)(const char*, int, ...);
+typedef ssize_t (*pread_fn)(int, void *, size_t, off_t);
+typedef ssize_t (*pwrite_fn)(int, const void *, size_t, off_t);
+typedef int     (*fsync_fn)(int);
 typedef ssize_t (*read_fn)(int, void *, size_t);
 typedef ssize_t (*readv_fn)(int, const struct iovec *, int);
 typedef ssize_t (*recv_fn)(int, void *, size_t, int);
@@ -49,6 +53,11 @@ static stat_fn     __sys_stat     = NULL;
 static lstat_fn    __sys_lstat    = NULL;
 static fstat_fn    __sys_fstat    = NULL;
 static mkdir_fn    __sys_mkdir    = NULL;
+static open_fn     __sys_open     = NULL;
+static pread_fn    __sys_pread    = NULL;
+static pwrite_fn   __sys_pwrite   = NULL;
+static fsync_fn    __sys_fsync    = NULL;
+static fsync_fn    __sys_fdatasync = NULL;
 static read_fn     __sys_read     = NULL;
 static readv_fn    __sys_readv    = NULL;
 static recv_fn     __sys_recv     = NULL;
@@ -98,6 +107,21 @@ void hook_io(void)
 	__sys_mkdir     = (mkdir_fn) dlsym(RTLD_NEXT, "mkdir");
 	acl_assert(__sys_mkdir);
 
+	__sys_open     = (open_fn) dlsym(RTLD_NEXT, "open");
+	acl_assert(__sys_open);
+
+	__sys_pread    = (pread_fn) dlsym(RTLD_NEXT, "pread");
+	acl_assert(__sys_pread);
+
+	__sys_pwrite   = (pwrite_fn) dlsym(RTLD_NEXT, "pwrite");
+	acl_assert(__sys_pwrite);
+
+	__sys_fsync    = (fsync_fn) dlsym(RTLD_NEXT, "fsync");
+	acl_assert(__sys_fsync);
+
+	__sys_fdatasync = (fsync_fn) dlsym(RTLD_NEXT, "fdatasync");
+	acl_assert(__sys_fdatasync);
+
 	__sys_stat     = (stat_fn) dlsym(RTLD_NEXT, "__xstat");
 	acl_assert(__sys_stat);
 
@@ -216,6 +240,110 @@ int mkdir(const char *pathname, mode_t mode)
 	return -1;
 }
 
+/* the regular files' IO called in the fibers are done by the helper
+ * threads in fiber_file.c, so the thread won't be blocked by the disk.
+ */
+
+int open(const char *pathname, int flags, ...)
+{
+	mode_t mode = 0;
+	int    fd;
+
+	if (flags & O_CREAT) {
+		va_list ap;
+
+		va_start(ap, flags);
+		mode = (mode_t) va_arg(ap, int);
+		va_end(ap);
+	}
+
+	if (__sys_open == NULL)
+		hook_io();
+
+	if (!acl_var_hook_sys_api)
+		return __sys_open(pathname, flags, mode);
+
+	if (fiber_file_io(-1))
+		return fiber_file_open(pathname, flags, mode);
+
+	fd = __sys_open(pathname, flags, mode);
+	if (fd < 0)
+		fiber_save_errno();
+	return fd;
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+	ssize_t ret;
+
+	if (__sys_pread == NULL)
+		hook_io();
+
+	if (!acl_var_hook_sys_api)
+		return __sys_pread(fd, buf, count, offset);
+
+	if (fiber_file_io(fd))
+		return fiber_file_pread(fd, buf, count, offset);
+
+	ret = __sys_pread(fd, buf, count, offset);
+	if (ret < 0)
+		fiber_save_errno();
+	return ret;
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	ssize_t ret;
+
+	if (__sys_pwrite == NULL)
+		hook_io();
+
+	if (!acl_var_hook_sys_api)
+		return __sys_pwrite(fd, buf, count, offset);
+
+	if (fiber_file_io(fd))
+		return fiber_file_pwrite(fd, buf, count, offset);
+
+	ret = __sys_pwrite(fd, buf, count, offset);
+	if (ret < 0)
+		fiber_save_errno();
+	return ret;
+}
+
+int fsync(int fd)
+{
+	if (__sys_fsync == NULL)
+		hook_io();
+
+	if (!acl_var_hook_sys_api)
+		return __sys_fsync(fd);
+
+	if (fiber_file_io(fd))
+		return fiber_file_fsync(fd);
+
+	if (__sys_fsync(fd) == 0)
+		return 0;
+	fiber_save_errno();
+	return -1;
+}
+
+int fdatasync(int fd)
+{
+	if (__sys_fdatasync == NULL)
+		hook_io();
+
+	if (!acl_var_hook_sys_api)
+		return __sys_fdatasync(fd);
+
+	if (fiber_file_io(fd))
+		return fiber_file_fdatasync(fd);
+
+	if (__sys_fdatasync(fd) == 0)
+		return 0;
+	fiber_save_errno();
+	return -1;
+}
+
 int __xstat(int ver, const char *path, struct stat *buf)
 {
 	if (__sys_stat == NULL)
@@ -356,6 +484,14 @@ inline ssize_t fiber_read(int fd, void *buf, size_t count)
 		return __sys_read(fd, buf, count);
 	}
 
+#ifdef	HAS_IO_URING
+	if (fiber_io_uring(fd))
+		return fiber_uring_read(fd, buf, count);
+#endif
+
+	if (fiber_file_io(fd))
+		return fiber_file_read(fd, buf, count);
+
 	ev = fiber_io_event();
 	if (ev && event_readable(ev, fd)) {
 		event_clear_readable(ev, fd);
@@ -367,8 +503,10 @@ inline ssize_t fiber_read(int fd, void *buf, size_t count)
 	}
 
 	fiber_wait_read(fd);
-	if (ev)
-		event_clear_readable(ev, fd);
+
+	/* the fiber may be resumed in another thread in M:N mode */
+	ev = fiber_io_event();
+	event_clear_readable(ev, fd);
 
 	ret = __sys_read(fd, buf, count);
 	if (ret >= 0)
@@ -402,6 +540,14 @@ inline ssize_t fiber_readv(int fd, const struct iovec *iov, int iovcnt)
 		return __sys_readv(fd, iov, iovcnt);
 	}
 
+#ifdef	HAS_IO_URING
+	if (fiber_io_uring(fd))
+		return fiber_uring_readv(fd, iov, iovcnt);
+#endif
+
+	if (fiber_file_io(fd))
+		return fiber_file_readv(fd, iov, iovcnt);
+
 	ev = fiber_io_event();
 	if (ev && event_readable(ev, fd)) {
 		event_clear_readable(ev, fd);
@@ -413,8 +559,8 @@ inline ssize_t fiber_readv(int fd, const struct iovec *iov, int iovcnt)
 	}
 
 	fiber_wait_read(fd);
-	if (ev)
-		event_clear_readable(ev, fd);
+	ev = fiber_io_event();
+	event_clear_readable(ev, fd);
 
 	ret = __sys_readv(fd, iov, iovcnt);
 	if (ret >= 0)
@@ -448,6 +594,11 @@ inline ssize_t fiber_recv(int sockfd, void *buf, size_t len, int flags)
 		return __sys_recv(sockfd, buf, len, flags);
 	}
 
+#ifdef	HAS_IO_URING
+	if (fiber_io_uring(sockfd))
+		return fiber_uring_recv(sockfd, buf, len, flags);
+#endif
+
 	ev = fiber_io_event();
 	if (ev && event_readable(ev, sockfd)) {
 		event_clear_readable(ev, sockfd);
@@ -459,8 +610,8 @@ inline ssize_t fiber_recv(int sockfd, void *buf, size_t len, int flags)
 	}
 
 	fiber_wait_read(sockfd);
-	if (ev)
-		event_clear_readable(ev, sockfd);
+	ev = fiber_io_event();
+	event_clear_readable(ev, sockfd);
 
 
 	ret = __sys_recv(sockfd, buf, len, flags);
@@ -497,6 +648,12 @@ inline ssize_t fiber_recvfrom(int sockfd, void *buf, size_t len, int flags,
 				flags, src_addr, addrlen);
 	}
 
+#ifdef	HAS_IO_URING
+	if (fiber_io_uring(sockfd))
+		return fiber_uring_recvfrom(sockfd, buf, len, flags,
+				src_addr, addrlen);
+#endif
+
 	ev = fiber_io_event();
 	if (ev && event_readable(ev, sockfd)) {
 		event_clear_readable(ev, sockfd);
@@ -509,8 +666,8 @@ inline ssize_t fiber_recvfrom(int sockfd, void *buf, size_t len, int flags,
 	}
 
 	fiber_wait_read(sockfd);
-	if (ev)
-		event_clear_readable(ev, sockfd);
+	ev = fiber_io_event();
+	event_clear_readable(ev, sockfd);
 
 	ret = __sys_recvfrom(sockfd, buf, len, flags, src_addr, addrlen);
 	if (ret >= 0)
@@ -546,6 +703,11 @@ inline ssize_t fiber_recvmsg(int sockfd, struct msghdr *msg, int flags)
 		return __sys_recvmsg(sockfd, msg, flags);
 	}
 
+#ifdef	HAS_IO_URING
+	if (fiber_io_uring(sockfd))
+		return fiber_uring_recvmsg(sockfd, msg, flags);
+#endif
+
 	ev = fiber_io_event();
 	if (ev && event_readable(ev, sockfd)) {
 		event_clear_readable(ev, sockfd);
@@ -557,8 +719,8 @@ inline ssize_t fiber_recvmsg(int sockfd, struct msghdr *msg, int flags)
 	}
 
 	fiber_wait_read(sockfd);
-	if (ev)
-		event_clear_readable(ev, sockfd);
+	ev = fiber_io_event();
+	event_clear_readable(ev, sockfd);
 
 	ret = __sys_recvmsg(sockfd, msg, flags);
 	if (ret >= 0)
@@ -763,6 +925,14 @@ inline ssize_t fiber_write(int fd, const void *buf, size_t count)
 	if (__sys_write == NULL)
 		hook_io();
 
+#ifdef	HAS_IO_URING
+	if (acl_var_hook_sys_api && fiber_io_uring(fd))
+		return fiber_uring_write(fd, buf, count);
+#endif
+
+	if (acl_var_hook_sys_api && fiber_file_io(fd))
+		return fiber_file_write(fd, buf, count);
+
 	while (1) {
 		ssize_t n = __sys_write(fd, buf, count);
 
@@ -800,6 +970,14 @@ inline ssize_t fiber_writev(int fd, const struct iovec *iov, int iovcnt)
 	if (__sys_writev == NULL)
 		hook_io();
 
+#ifdef	HAS_IO_URING
+	if (acl_var_hook_sys_api && fiber_io_uring(fd))
+		return fiber_uring_writev(fd, iov, iovcnt);
+#endif
+
+	if (acl_var_hook_sys_api && fiber_file_io(fd))
+		return fiber_file_writev(fd, iov, iovcnt);
+
 	while (1) {
 		ssize_t n = __sys_writev(fd, iov, iovcnt);
 
@@ -837,6 +1015,11 @@ inline ssize_t fiber_send(int sockfd, const void *buf, size_t len, int flags)
 	if (__sys_send == NULL)
 		hook_io();
 
+#ifdef	HAS_IO_URING
+	if (acl_var_hook_sys_api && fiber_io_uring(sockfd))
+		return fiber_uring_send(sockfd, buf, len, flags);
+#endif
+
 	while (1) {
 		ssize_t n = __sys_send(sockfd, buf, len, flags);
 
@@ -875,6 +1058,12 @@ inline ssize_t fiber_sendto(int sockfd, const void *buf, size_t len, int flags,
 	if (__sys_sendto == NULL)
 		hook_io();
 
+#ifdef	HAS_IO_URING
+	if (acl_var_hook_sys_api && fiber_io_uring(sockfd))
+		return fiber_uring_sendto(sockfd, buf, len, flags,
+				dest_addr, addrlen);
+#endif
+
 	while (1) {
 		ssize_t n = __sys_sendto(sockfd, buf, len, flags,
 				dest_addr, addrlen);
@@ -913,6 +1102,11 @@ inline ssize_t fiber_sendmsg(int sockfd, const struct msghdr *msg, int flags)
 	if (__sys_sendmsg == NULL)
 		hook_io();
 
+#ifdef	HAS_IO_URING
+	if (acl_var_hook_sys_api && fiber_io_uring(sockfd))
+		return fiber_uring_sendmsg(sockfd, msg, flags);
+#endif
+
 	while (1) {
 		ssize_t n = __sys_sendmsg(sockfd, msg, flags);
 
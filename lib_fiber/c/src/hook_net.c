@@ -208,6 +208,11 @@ int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 	if (!acl_var_hook_sys_api)
 		return __sys_accept ? __sys_accept(sockfd, addr, addrlen) : -1;
 
+#ifdef	HAS_IO_URING
+	if (fiber_io_uring(sockfd))
+		return fiber_uring_accept(sockfd, addr, addrlen);
+#endif
+
 	me = acl_fiber_running();
 
 #ifdef	FAST_ACCEPT
@@ -234,8 +239,10 @@ int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 		return -1;
 
 	fiber_wait_read(sockfd);
-	if (ev)
-		event_clear_readable(ev, sockfd);
+
+	/* the fiber may be resumed in another thread in M:N mode */
+	ev = fiber_io_event();
+	event_clear_readable(ev, sockfd);
 
 	if (acl_fiber_killed(me)) {
 		acl_msg_info("%s(%d), %s: fiber-%u was killed",
@@ -267,8 +274,8 @@ int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 	}
 
 	fiber_wait_read(sockfd);
-	if (ev)
-		event_clear_readable(ev, sockfd);
+	ev = fiber_io_event();
+	event_clear_readable(ev, sockfd);
 
 	if (acl_fiber_killed(me)) {
 		acl_msg_info("%s(%d), %s: fiber-%u was killed",
@@ -310,6 +317,11 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
 		return -1;
 	}
 
+#ifdef	HAS_IO_URING
+	if (fiber_io_uring(sockfd))
+		return fiber_uring_connect(sockfd, addr, addrlen);
+#endif
+
 	acl_non_blocking(sockfd, ACL_NON_BLOCKING);
 
 	int ret = __sys_connect(sockfd, addr, addrlen);
@@ -518,7 +530,8 @@ int __poll(struct pollfd fds[], nfds_t nfds, int timeout)
 
 int poll(struct pollfd *fds, nfds_t nfds, int timeout)
 {
-	POLL_EVENT pe;
+	POLL_EVENT pev, *pe = &pev;
+	ACL_FIBER *me;
 	EVENT *ev;
 	acl_int64 begin, now;
 
@@ -528,33 +541,51 @@ int poll(struct pollfd *fds, nfds_t nfds, int timeout)
 	if (!acl_var_hook_sys_api)
 		return __sys_poll ? __sys_poll(fds, nfds, timeout) : -1;
 
-	ev        = fiber_io_event();
-	pe.fds    = fds;
-	pe.nfds   = nfds;
-	pe.fiber  = acl_fiber_running();
-	pe.proc   = poll_callback;
-	pe.nready = 0;
+	ev = fiber_io_event();
+	me = acl_fiber_running();
+
+	/* the event loop accesses them while the fiber is switched out, when
+	 * the shared stack may be used by another fiber
+	 */
+	if (me->flag & FIBER_F_SHARED) {
+		pe = (POLL_EVENT *) acl_mymalloc(sizeof(POLL_EVENT));
+		pe->fds = (struct pollfd *) acl_mycalloc(nfds + 1,
+			sizeof(struct pollfd));
+		if (nfds > 0)
+			memcpy(pe->fds, fds, nfds * sizeof(struct pollfd));
+	} else
+		pe->fds = fds;
+
+	pe->nfds   = nfds;
+	pe->fiber  = me;
+	pe->proc   = poll_callback;
+	pe->nready = 0;
 
 	SET_TIME(begin);
 
+	/* the poll events belong to the thread, so the fiber mustn't be
+	 * stolen by other threads in M:N mode
+	 */
+	pe->fiber->flag |= FIBER_F_PINNED;
+
 	while (1) {
-		event_poll_set(ev, &pe, timeout);
+		event_poll_set(ev, pe, timeout);
 		fiber_io_inc();
 		acl_fiber_switch();
 
-		if (acl_fiber_killed(pe.fiber)) {
-			event_poll_clear(ev, &pe);
+		if (acl_fiber_killed(pe->fiber)) {
+			event_poll_clear(ev, pe);
 			acl_msg_info("%s(%d), %s: fiber-%u was killed, %s",
 				__FILE__, __LINE__, __FUNCTION__,
-				acl_fiber_id(pe.fiber), acl_last_serror());
-			pe.nready = -1;
+				acl_fiber_id(pe->fiber), acl_last_serror());
+			pe->nready = -1;
 			break;
 		}
 
 		if (acl_ring_size(&ev->poll_list) == 0)
 			ev->timeout = -1;
 
-		if (pe.nready != 0 || timeout == 0)
+		if (pe->nready != 0 || timeout == 0)
 			break;
 
 		SET_TIME(now);
@@ -563,7 +594,17 @@ int poll(struct pollfd *fds, nfds_t nfds, int timeout)
 			break;
 	}
 
-	return pe.nready;
+	pe->fiber->flag &= ~FIBER_F_PINNED;
+
+	if (pe != &pev) {
+		if (nfds > 0)
+			memcpy(fds, pe->fds, nfds * sizeof(struct pollfd));
+		pev.nready = pe->nready;
+		acl_myfree(pe->fds);
+		acl_myfree(pe);
+	}
+
+	return pev.nready;
 }
 
 int select(int nfds, fd_set *readfds, fd_set *writefds,
@@ -1019,12 +1060,21 @@ int epoll_wait(int epfd, struct epoll_event *events,
 		return -1;
 	}
 
-	ee->events    = events;
-	ee->maxevents = maxevents;
 	ee->fiber     = acl_fiber_running();
+	ee->maxevents = maxevents;
 	ee->proc      = epoll_callback;
 
+	/* the events are filled while the fiber is switched out, when the
+	 * shared stack may be used by another fiber
+	 */
+	if ((ee->fiber->flag & FIBER_F_SHARED) && maxevents > 0)
+		ee->events = (struct epoll_event *) acl_mymalloc(
+			maxevents * sizeof(struct epoll_event));
+	else
+		ee->events = events;
+
 	SET_TIME(begin);
+	ee->fiber->flag |= FIBER_F_PINNED;
 
 	while (1) {
 		event_epoll_set(ev, ee, timeout);
@@ -1050,92 +1100,23 @@ int epoll_wait(int epfd, struct epoll_event *events,
 			break;
 	}
 
+	ee->fiber->flag &= ~FIBER_F_PINNED;
+
+	if (ee->events != events) {
+		if (ee->nready > 0)
+			memcpy(events, ee->events,
+				ee->nready * sizeof(struct epoll_event));
+		acl_myfree(ee->events);
+		ee->events = events;
+	}
+
 	return ee->nready;
 }
 
 /****************************************************************************/
 
-static const char *__dns_ip_default = "8.8.8.8";
-static char __dns_ip[128] = { 0 };
-static int  __dns_port = 53;
-
-void acl_fiber_set_dns(const char* ip, int port)
-{
-	if (ip == NULL || *ip == 0)
-		__dns_ip[0] = 0;
-	else
-		snprintf(__dns_ip, sizeof(__dns_ip), "%s", ip);
-
-	__dns_port = port > 0 ? port : 53;
-}
-
 #define SKIP_WHILE(cond, cp) { while (*cp && (cond)) cp++; }
 
-static void get_dns(char *ip, size_t size)
-{
-	const char *filepath = "/etc/resolv.conf";
-	ACL_VSTREAM *fp;
-	char buf[4096], *ptr;
-	ACL_ARGV *tokens;
-	static acl_pthread_mutex_t __lock = PTHREAD_MUTEX_INITIALIZER;
-
-	(void) acl_pthread_mutex_lock(&__lock);
-
-	if (__dns_ip[0] != 0) {
-		ACL_SAFE_STRNCPY(ip, __dns_ip, size);
-		(void) acl_pthread_mutex_unlock(&__lock);
-		return;
-	}
-
-	fp = acl_vstream_fopen(filepath, O_RDONLY, 066, 4096);
-	if (fp == NULL) {
-		(void) acl_pthread_mutex_unlock(&__lock);
-		ACL_SAFE_STRNCPY(ip, __dns_ip_default, size);
-
-		return;
-	}
-
-	__dns_ip[0] = 0;
-
-	while (acl_vstream_gets_nonl(fp, buf, sizeof(buf)) != ACL_VSTREAM_EOF) {
-		ptr = buf;
-		SKIP_WHILE(*ptr == ' ' || *ptr == '\t' || *ptr == '#', ptr);
-		if (*ptr == 0)
-			continue;
-
-		tokens = acl_argv_split(ptr, " \t");
-		if (tokens->argc < 2) {
-			acl_argv_free(tokens);
-			continue;
-		}
-
-		if (strcasecmp(tokens->argv[0], "nameserver") != 0) {
-			acl_argv_free(tokens);
-			continue;
-		}
-
-		if (!acl_is_ip(tokens->argv[1])) {
-			acl_argv_free(tokens);
-			continue;
-		}
-
-		snprintf(__dns_ip, sizeof(__dns_ip), "%s", tokens->argv[1]);
-		acl_argv_free(tokens);
-		break;
-	}
-
-	acl_vstream_close(fp);
-
-	if (__dns_ip[0] == 0) {
-		(void) acl_pthread_mutex_unlock(&__lock);
-		ACL_SAFE_STRNCPY(ip, __dns_ip_default, size);
-		return;
-	}
-
-	ACL_SAFE_STRNCPY(ip, __dns_ip, size);
-	(void) acl_pthread_mutex_unlock(&__lock);
-}
-
 struct hostent *gethostbyname(const char *name)
 {
 	static __thread struct hostent ret, *result;
@@ -1149,17 +1130,14 @@ struct hostent *gethostbyname(const char *name)
 int gethostbyname_r(const char *name, struct hostent *ret,
 	char *buf, size_t buflen, struct hostent **result, int *h_errnop)
 {
-	ACL_RES *ns = NULL;
-	ACL_DNS_DB *res = NULL;
+	ACL_ARGV *res = NULL;
 	size_t n = 0, len, i = 0;
 	ACL_ITER iter;
-	char dns_ip[64];
+	int herr;
 
 #define	RETURN(x) do { \
 	if (res) \
-		acl_netdb_free(res); \
-	if (ns) \
-		acl_res_free(ns); \
+		acl_argv_free(res); \
 	return (x); \
 } while (0)
 
@@ -1170,20 +1148,13 @@ int gethostbyname_r(const char *name, struct hostent *ret,
 		return __sys_gethostbyname_r ?  __sys_gethostbyname_r
 			(name, ret, buf, buflen, result, h_errnop) : -1;
 
-	get_dns(dns_ip, sizeof(dns_ip));
-
 	memset(ret, 0, sizeof(struct hostent));
 	memset(buf, 0, buflen);
 
-	ns = acl_res_new(dns_ip, __dns_port);
-	res = acl_res_lookup(ns, name);
-
+	res = fiber_dns_lookup(name, &herr);
 	if (res == NULL) {
-		acl_msg_error("%s(%d), %s: acl_res_lookup NULL, name: %s,"
-			" dns_ip: %s, dns_port: %d", __FILE__, __LINE__,
-			__FUNCTION__, name, dns_ip, __dns_port);
 		if (h_errnop)
-			*h_errnop = HOST_NOT_FOUND;
+			*h_errnop = herr;
 		RETURN (-1);
 	}
 
@@ -1211,11 +1182,13 @@ int gethostbyname_r(const char *name, struct hostent *ret,
 			*h_errnop = ERANGE;
 		RETURN (-1);
 	}
+	ret->h_addrtype  = AF_INET;
+	ret->h_length    = sizeof(struct in_addr);
 	ret->h_addr_list = (char**) buf;
 	buf += len;
 
 	acl_foreach(iter, res) {
-		ACL_HOSTNAME *h = (ACL_HOSTNAME*) iter.data;
+		const char *ip = (const char *) iter.data;
 		struct in_addr addr;
 
 		len = sizeof(struct in_addr);
@@ -1224,14 +1197,13 @@ int gethostbyname_r(const char *name, struct hostent *ret,
 			break;
 
 		memset(&addr, 0, sizeof(addr));
-		addr.s_addr = inet_addr(h->ip);
+		addr.s_addr = inet_addr(ip);
 		memcpy(buf, &addr, len);
 
 		if (i >= MAX_COUNT)
 			break;
 		ret->h_addr_list[i++] = buf;
 		buf += len;
-		ret->h_length += len;
 	}
 
 	if (i > 0) {
@@ -1362,12 +1334,10 @@ static struct addrinfo *create_addrinfo(const char *ip, short port,
 int getaddrinfo(const char *node, const char *service,
 	const struct addrinfo* hints, struct addrinfo **res)
 {
-	ACL_RES *ns;
-	ACL_DNS_DB *db;
+	ACL_ARGV *ips;
 	short port;
 	ACL_ITER iter;
-	char dns_ip[64];
-	int  socktype = hints ? hints->ai_socktype : SOCK_STREAM;
+	int  herr, socktype = hints ? hints->ai_socktype : SOCK_STREAM;
 
 	if (__sys_getaddrinfo == NULL)
 		hook_net();
@@ -1391,21 +1361,13 @@ int getaddrinfo(const char *node, const char *service,
 			return EAI_NODATA;
 	}
 
-	get_dns(dns_ip, sizeof(dns_ip));
-
-	ns = acl_res_new(dns_ip, __dns_port);
-	db = acl_res_lookup(ns, node);
-	if (db == NULL) {
-		acl_msg_error("%s(%d), %s: acl_res_lookup NULL, node: %s,"
-			" dns_ip: %s, dns_port: %d", __FILE__, __LINE__,
-			__FUNCTION__, node, dns_ip, __dns_port);
-		acl_res_free(ns);
-		return EAI_NODATA;
-	}
+	ips = fiber_dns_lookup(node, &herr);
+	if (ips == NULL)
+		return herr == HOST_NOT_FOUND ? EAI_NODATA : EAI_AGAIN;
 
-	acl_foreach(iter, db) {
-		ACL_HOSTNAME *h = (ACL_HOSTNAME *) iter.data;
-		struct addrinfo *ai = create_addrinfo(h->ip, port, socktype,
+	acl_foreach(iter, ips) {
+		const char *ip = (const char *) iter.data;
+		struct addrinfo *ai = create_addrinfo(ip, port, socktype,
 			hints ? hints->ai_flags : 0);
 		if (ai) {
 			ai->ai_next = *res;
@@ -1413,8 +1375,7 @@ int getaddrinfo(const char *node, const char *service,
 		}
 	}
 
-	acl_netdb_free(db);
-	acl_res_free(ns);
+	acl_argv_free(ips);
 	return 0;
 }
 
@@ -1,6 +1,10 @@
 #include "stdafx.h"
 #include <stdarg.h>
 #include <poll.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#endif
 
 /* including the internal headers from lib_acl/src/master */
 #include "template/master_log.h"
@@ -23,6 +27,7 @@ static int   acl_var_fiber_use_limit;
 static int   acl_var_fiber_idle_limit;
 static int   acl_var_fiber_wait_limit;
 static int   acl_var_fiber_threads;
+static int   acl_var_fiber_backlog;
 static ACL_CONFIG_INT_TABLE __conf_int_tab[] = {
 	{ "fiber_stack_size", STACK_SIZE, &acl_var_fiber_stack_size, 0, 0 },
 	{ "fiber_buf_size", 8192, &acl_var_fiber_buf_size, 0, 0 },
@@ -33,6 +38,7 @@ static ACL_CONFIG_INT_TABLE __conf_int_tab[] = {
 	{ "fiber_idle_limit", 0, &acl_var_fiber_idle_limit, 0 , 0 },
 	{ "fiber_wait_limit", 0, &acl_var_fiber_wait_limit, 0, 0 },
 	{ "fiber_threads", 1, &acl_var_fiber_threads, 0, 0 },
+	{ "fiber_backlog", 128, &acl_var_fiber_backlog, 0, 0 },
 
 	{ 0, 0, 0, 0, 0 },
 };
@@ -44,7 +50,8 @@ static char *acl_var_fiber_access_allow;
 static char *acl_var_fiber_owner;
 static char *acl_var_fiber_dispatch_addr;
 static char *acl_var_fiber_dispatch_type;
-static char *acl_var_fiber_reuseport;     /* just for stand alone */
+static char *acl_var_fiber_reuseport;
+static char *acl_var_fiber_status_addr;
 static ACL_CONFIG_STR_TABLE __conf_str_tab[] = {
 	{ "fiber_queue_dir", "", &acl_var_fiber_queue_dir },
 	{ "fiber_log_debug", "all:1", &acl_var_fiber_log_debug },
@@ -54,13 +61,18 @@ static ACL_CONFIG_STR_TABLE __conf_str_tab[] = {
 	{ "fiber_dispatch_addr", "", &acl_var_fiber_dispatch_addr },
 	{ "fiber_dispatch_type", "default", &acl_var_fiber_dispatch_type },
 	{ "master_reuseport", "", &acl_var_fiber_reuseport },
+	{ "fiber_status_addr", "", &acl_var_fiber_status_addr },
 
 	{ 0, 0, 0 },
 };
 
 static int  acl_var_fiber_quick_abort;
+static int  acl_var_fiber_profile;
+static int  acl_var_fiber_reuseport_cpu;
 static ACL_CONFIG_BOOL_TABLE __conf_bool_tab[] = {
 	{ "fiber_quick_abort", 1, &acl_var_fiber_quick_abort },
+	{ "fiber_profile", 0, &acl_var_fiber_profile },
+	{ "fiber_reuseport_cpu", 0, &acl_var_fiber_reuseport_cpu },
 
 	{ 0, 0, 0 },
 };
@@ -86,12 +98,16 @@ static ACL_ATOMIC_CLOCK *__clock = NULL;
 
 typedef struct FIBER_SERVER {
 	acl_pthread_t tid;
+	int           index;	/* the thread's index */
 	ACL_MBOX     *in;
 	ACL_MBOX     *out;
 	ACL_VSTREAM **sstreams;
 	ACL_FIBER   **accepters;
 	int           socket_count;
 	int           fdtype;
+	ACL_FIBER    *stater;
+	acl_pthread_mutex_t lock;	/* protecting status */
+	ACL_VSTRING  *status;	/* the snapshot of the thread's fibers */
 } FIBER_SERVER;
 
 const char *acl_fiber_server_conf(void)
@@ -164,6 +180,31 @@ static void thread_fiber_accept(ACL_FIBER *fiber, void *ctx)
 	}
 }
 
+#define	STATUS_TOP	20
+#define	STATUS_SIZE	8192
+
+/* the fibers of a thread can only be visited in the thread, so the snapshot
+ * is taken by each thread every second, for the status service in the main
+ * thread.
+ */
+static void thread_fiber_status(ACL_FIBER *fiber, void *ctx)
+{
+	FIBER_SERVER *server = (FIBER_SERVER *) ctx;
+	char *buf = (char *) acl_mymalloc(STATUS_SIZE);
+
+	while (!acl_fiber_killed(fiber)) {
+		acl_fiber_stat_top(buf, STATUS_SIZE, STATUS_TOP);
+
+		acl_pthread_mutex_lock(&server->lock);
+		acl_vstring_strcpy(server->status, buf);
+		acl_pthread_mutex_unlock(&server->lock);
+
+		acl_fiber_sleep(1);
+	}
+
+	acl_myfree(buf);
+}
+
 static void thread_fiber_monitor(ACL_FIBER *fiber acl_unused, void *ctx)
 {
 	FIBER_SERVER *server = (FIBER_SERVER *) ctx;
@@ -175,16 +216,45 @@ static void thread_fiber_monitor(ACL_FIBER *fiber acl_unused, void *ctx)
 	for (i = 0; i < server->socket_count; i++)
 		acl_fiber_kill(server->accepters[i]);
 
+	if (server->stater)
+		acl_fiber_kill(server->stater);
+
 	// notify schedule to stop now
 	acl_fiber_schedule_stop();
 }
 
+static int __steer_cpu = 0;
+
+/* each thread runs on the CPU whose connections are steered to it */
+static void thread_bind_cpu(FIBER_SERVER *server)
+{
+#ifdef __linux__
+#define	MASK_BITS	(8 * sizeof(unsigned long))
+	unsigned long mask[1024 / MASK_BITS];
+
+	/* the cpu_set_t macros need _GNU_SOURCE before any header */
+	memset(mask, 0, sizeof(mask));
+	mask[(server->index / MASK_BITS) % (sizeof(mask) / sizeof(mask[0]))]
+		|= 1UL << (server->index % MASK_BITS);
+
+	if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0)
+		acl_msg_warn("%s(%d), %s: bind thread-%d to cpu error %s",
+			__FILE__, __LINE__, __FUNCTION__, server->index,
+			acl_last_serror());
+#else
+	(void) server;
+#endif
+}
+
 static void *thread_main(void *ctx)
 {
 	FIBER_SERVER *server =(FIBER_SERVER *) ctx;
 	static int dummy;
 	int i;
 
+	if (__steer_cpu)
+		thread_bind_cpu(server);
+
 	if (__thread_init)
 		__thread_init(__thread_init_ctx);
 
@@ -193,6 +263,10 @@ static void *thread_main(void *ctx)
 		server->accepters[i] = acl_fiber_create(
 			thread_fiber_accept, server->sstreams[i], STACK_SIZE);
 
+	if (acl_var_fiber_status_addr && *acl_var_fiber_status_addr)
+		server->stater = acl_fiber_create(thread_fiber_status,
+			server, STACK_SIZE);
+
 	// create monitor fiber waiting STOPPING command from main thread
 	acl_fiber_create(thread_fiber_monitor, server, STACK_SIZE);
 
@@ -411,6 +485,59 @@ static void main_fiber_dispatch(ACL_FIBER *fiber, void *ctx acl_unused)
 		__FUNCTION__, acl_fiber_id(fiber));
 }
 
+static void main_status_reply(ACL_VSTREAM *conn)
+{
+	ACL_VSTRING *buf = acl_vstring_alloc(STATUS_SIZE);
+	int i;
+
+	acl_vstring_sprintf(buf, "pid=%u, threads=%d, clients=%lld, "
+		"used=%llu\r\n", (unsigned) getpid(), acl_var_fiber_threads,
+		acl_atomic_clock_users(__clock),
+		(unsigned long long) acl_atomic_clock_count(__clock));
+
+	for (i = 0; __servers && __servers[i] != NULL; i++) {
+		acl_pthread_mutex_lock(&__servers[i]->lock);
+		acl_vstring_strcat(buf, acl_vstring_str(__servers[i]->status));
+		acl_pthread_mutex_unlock(&__servers[i]->lock);
+	}
+
+	(void) acl_vstream_writen(conn, acl_vstring_str(buf), ACL_VSTRING_LEN(buf));
+	acl_vstring_free(buf);
+}
+
+/* the status service reports the fibers of all the threads, just like
+ * "curl http://status_addr" or "nc status_addr" to get them.
+ */
+static void main_fiber_status(ACL_FIBER *fiber, void *ctx acl_unused)
+{
+	ACL_VSTREAM *sstream, *conn;
+
+	sstream = acl_vstream_listen(acl_var_fiber_status_addr, 128);
+	if (sstream == NULL) {
+		acl_msg_error("%s(%d), %s: listen %s error %s", __FILE__,
+			__LINE__, __FUNCTION__, acl_var_fiber_status_addr,
+			acl_last_serror());
+		return;
+	}
+
+	acl_msg_info("%s(%d), %s: status service on %s", __FILE__,
+		__LINE__, __FUNCTION__, acl_var_fiber_status_addr);
+
+	while (!__server_stopping && !acl_fiber_killed(fiber)) {
+		conn = acl_vstream_accept(sstream, NULL, 0);
+		if (conn == NULL) {
+			if (errno != ACL_EAGAIN && errno != ACL_EINTR)
+				acl_fiber_sleep(1);
+			continue;
+		}
+
+		main_status_reply(conn);
+		acl_vstream_close(conn);
+	}
+
+	acl_vstream_close(sstream);
+}
+
 static void main_fiber_sighup(ACL_FIBER *fiber, void *ctx acl_unused)
 {
 	ACL_VSTRING *buf;
@@ -521,6 +648,9 @@ static void main_thread_loop(void)
 	__sighup_fiber = acl_fiber_create(main_fiber_sighup, NULL,
 		acl_var_fiber_stack_size);
 
+	if (acl_var_fiber_status_addr && *acl_var_fiber_status_addr)
+		acl_fiber_create(main_fiber_status, NULL, STACK_SIZE);
+
 	if (acl_var_fiber_use_limit > 0)
 		acl_fiber_create(main_fiber_monitor_used, NULL, STACK_SIZE);
 
@@ -545,6 +675,8 @@ static FIBER_SERVER *server_alloc(int socket_count, int fdtype)
 	server->fdtype       = fdtype;
 	server->in           = acl_mbox_create();
 	server->out          = acl_mbox_create();
+	server->status       = acl_vstring_alloc(STATUS_SIZE);
+	acl_pthread_mutex_init(&server->lock, NULL);
 
 	server->sstreams  = (ACL_VSTREAM **)
 		acl_mycalloc(socket_count, sizeof(ACL_VSTREAM *));
@@ -565,6 +697,8 @@ static void server_free(FIBER_SERVER *server)
 	acl_myfree(server->accepters);
 	acl_mbox_free(server->in, NULL);
 	acl_mbox_free(server->out, NULL);
+	acl_vstring_free(server->status);
+	acl_pthread_mutex_destroy(&server->lock);
 	if (__clock) {
 		acl_atomic_clock_free(__clock);
 		__clock = NULL;
@@ -578,12 +712,106 @@ static FIBER_SERVER **servers_alloc(int nthreads, int socket_count, int fdtype)
 		acl_mycalloc(nthreads + 1, sizeof(FIBER_SERVER*));
 	int i;
 
-	for (i = 0; i < nthreads; i++)
+	for (i = 0; i < nthreads; i++) {
 		servers[i] = server_alloc(socket_count, fdtype);
+		servers[i]->index = i;
+	}
 
 	return servers;
 }
 
+static int server_reuseport(void)
+{
+#define EQ !strcasecmp
+	return EQ(acl_var_fiber_reuseport, "yes") ||
+		EQ(acl_var_fiber_reuseport, "true") ||
+		EQ(acl_var_fiber_reuseport, "on");
+}
+
+/* check if the listening socket can be opened again by each thread */
+static int listen_reusable(ACL_SOCKET fd)
+{
+#ifdef SO_REUSEPORT
+	struct sockaddr_storage sa;
+	socklen_t len = sizeof(sa);
+	int on = 0;
+
+	if (getsockname(fd, (struct sockaddr *) &sa, &len) < 0
+		|| (sa.ss_family != AF_INET && sa.ss_family != AF_INET6)) {
+
+		return 0;
+	}
+
+	len = sizeof(on);
+	if (getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, &len) < 0)
+		return 0;
+	return on;
+#else
+	(void) fd;
+	return 0;
+#endif
+}
+
+/* let the kernel select the socket by the CPU handling the connection, so
+ * the connection is accepted by the thread running on the same CPU; the
+ * program is shared by all the sockets in the group, and the index of the
+ * socket in the group is the order of binding, so it works only when all
+ * the sockets in the group are opened by one process in the thread order.
+ */
+static void listen_steer(ACL_SOCKET fd, int nthreads)
+{
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+	struct sock_filter code[] = {
+		{ BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned) nthreads },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog;
+
+	prog.len    = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+		&prog, sizeof(prog)) < 0) {
+
+		acl_msg_warn("%s(%d), %s: attach reuseport cbpf error %s",
+			__FILE__, __LINE__, __FUNCTION__, acl_last_serror());
+		__steer_cpu = 0;
+	}
+#else
+	(void) fd;
+	(void) nthreads;
+	acl_msg_warn("%s(%d), %s: steering by CPU not supported",
+		__FILE__, __LINE__, __FUNCTION__);
+	__steer_cpu = 0;
+#endif
+}
+
+static void servers_steer(int nthreads)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+
+	if (!acl_var_fiber_reuseport_cpu || nthreads <= 1)
+		return;
+
+	/* the threads without their own CPUs would get no connection */
+	if (ncpu > 0 && nthreads > ncpu) {
+		acl_msg_warn("%s(%d), %s: fiber_threads(%d) > cpus(%ld), "
+			"no steering by CPU", __FILE__, __LINE__,
+			__FUNCTION__, nthreads, ncpu);
+		return;
+	}
+
+	__steer_cpu = 1;
+	for (i = 0; i < __servers[0]->socket_count && __steer_cpu; i++) {
+		ACL_SOCKET fd = ACL_VSTREAM_SOCK(__servers[0]->sstreams[i]);
+
+		if (listen_reusable(fd))
+			listen_steer(fd, nthreads);
+	}
+}
+
 static void server_daemon_open(FIBER_SERVER *server)
 {
 	ACL_SOCKET fd = ACL_MASTER_LISTEN_FD;
@@ -597,14 +825,59 @@ static void server_daemon_open(FIBER_SERVER *server)
 	}
 }
 
+/* open the thread's own listening sockets on the addresses of the sockets
+ * from acl_master, which must have been set SO_REUSEPORT by acl_master with
+ * "master_reuseport = yes", or the ones from acl_master are shared.
+ */
+static void server_daemon_reuse(FIBER_SERVER *server)
+{
+	ACL_SOCKET fd = ACL_MASTER_LISTEN_FD;
+	char  addr[256];
+	int   i;
+
+	for (i = 0; fd < ACL_MASTER_LISTEN_FD + server->socket_count; fd++) {
+		ACL_VSTREAM *sstream = NULL;
+
+		if (listen_reusable(fd)
+			&& acl_getsockname(fd, addr, sizeof(addr)) == 0) {
+
+			sstream = acl_vstream_listen_ex(addr,
+				acl_var_fiber_backlog, ACL_INET_FLAG_REUSEPORT,
+				acl_var_fiber_buf_size,
+				acl_var_fiber_rw_timeout);
+			if (sstream == NULL)
+				acl_msg_warn("%s(%d), %s: listen %s error %s,"
+					" share the one from acl_master",
+					__FILE__, __LINE__, __FUNCTION__,
+					addr, acl_last_serror());
+		}
+
+		if (sstream == NULL)
+			sstream = acl_vstream_fdopen(fd, O_RDWR,
+				acl_var_fiber_buf_size,
+				acl_var_fiber_rw_timeout, server->fdtype);
+
+		acl_close_on_exec(ACL_VSTREAM_SOCK(sstream), ACL_CLOSE_ON_EXEC);
+		server->sstreams[i++] = sstream;
+	}
+}
+
 static void servers_daemon(int count, int fdtype, int nthreads)
 {
-	int i;
+	int i, reuse = server_reuseport();
 
 	__servers = servers_alloc(nthreads, count, fdtype);
 
-	for (i = 0; i < nthreads; i++)
-		server_daemon_open(__servers[i]);
+	/* the first thread uses the sockets from acl_master */
+	for (i = 0; i < nthreads; i++) {
+		if (i > 0 && reuse)
+			server_daemon_reuse(__servers[i]);
+		else
+			server_daemon_open(__servers[i]);
+	}
+
+	if (reuse)
+		servers_steer(nthreads);
 }
 
 static void server_alone_open(FIBER_SERVER *server, ACL_ARGV *addrs)
@@ -614,18 +887,13 @@ static void server_alone_open(FIBER_SERVER *server, ACL_ARGV *addrs)
 	unsigned flag = ACL_INET_FLAG_NONE;
 	int i = 0;
 
-#define EQ !strcasecmp
-	if (EQ(acl_var_fiber_reuseport, "yes") ||
-		EQ(acl_var_fiber_reuseport, "true") ||
-		EQ(acl_var_fiber_reuseport, "on")) {
-
+	if (server_reuseport())
 		flag |= ACL_INET_FLAG_REUSEPORT;
-	}
 
 	acl_foreach(iter, addrs) {
 		const char* addr = (const char*) iter.data;
-		ACL_VSTREAM* sstream = acl_vstream_listen_ex(
-				addr, 128, flag, 0, 0);
+		ACL_VSTREAM* sstream = acl_vstream_listen_ex(addr,
+				acl_var_fiber_backlog, flag, 0, 0);
 		if (sstream == NULL) {
 			acl_msg_error("%s(%d): listen %s error(%s)",
 				myname, __LINE__, addr, acl_last_serror());
@@ -646,6 +914,9 @@ static void servers_alone(const char *addrs, int fdtype, int nthreads)
 	for (i = 0; i < nthreads; i++)
 		server_alone_open(__servers[i], tokens);
 
+	if (server_reuseport())
+		servers_steer(nthreads);
+
 	acl_argv_free(tokens);
 }
 
@@ -742,6 +1013,9 @@ static void server_init(const char *procname)
 	acl_get_app_conf_str_table(__conf_str_tab);
 	acl_get_app_conf_bool_table(__conf_bool_tab);
 
+	if (acl_var_fiber_profile)
+		acl_fiber_profile(1);
+
 	if (__deny_info == NULL)
 		__deny_info = acl_var_fiber_deny_banner;
 	if (acl_var_fiber_access_allow && *acl_var_fiber_access_allow)
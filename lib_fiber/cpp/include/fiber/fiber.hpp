@@ -79,6 +79,13 @@ public:
 	 */
 	static void schedule(void);
 
+	/**
+	 * 以 M:N 方式启动协程调度过程，由多个线程共同调度当前线程中已创建的协程，
+	 * 空闲的线程会从繁忙的线程中窃取就绪的协程，当所有协程都退出后返回
+	 * @param nthreads {int} 参与调度的线程数
+	 */
+	static void schedule_mn(int nthreads);
+
 	/**
 	 * 判断当前线程是否处于协程调度状态
 	 * @return {bool}
@@ -129,6 +129,11 @@ void fiber::schedule(void)
 	acl_fiber_schedule();
 }
 
+void fiber::schedule_mn(int nthreads)
+{
+	acl_fiber_schedule_mn(nthreads);
+}
+
 bool fiber::scheduled(void)
 {
 	return acl_fiber_scheduled() != 0;
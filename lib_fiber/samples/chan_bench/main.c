@@ -0,0 +1,246 @@
+#include "lib_acl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "fiber/lib_fiber.h"
+
+/* Passing the messages from the fibers in the producer threads to the
+ * fibers in the consumer threads, through one ACL_FIBER_CHAN shared by all
+ * the consumers, or through one ACL_MBOX for each consumer which wakes up
+ * the reader by writing a socketpair.
+ */
+
+static int  __nproducers = 2;
+static int  __nconsumers = 2;
+static int  __nfibers    = 4;	/* the sending fibers in each producer */
+static int  __count      = 1000000;
+static int  __capacity   = 1024;
+static int  __batch      = 0;
+static int  __use_mbox   = 0;
+
+static ACL_FIBER_CHAN *__chan  = NULL;
+static ACL_MBOX      **__mboxes = NULL;
+static long long __nrecv = 0;
+static char __msg[]  = "hello world";
+static char __stop[] = "stop";
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+typedef struct {
+	int index;
+	int nleft;
+} THREAD;
+
+static void send_fiber(ACL_FIBER *fiber acl_unused, void *ctx)
+{
+	THREAD *thread = (THREAD *) ctx;
+	void  *msgs[64];
+	int    i, n, count = __count / __nproducers / __nfibers;
+
+	for (i = 0; i < count;) {
+		if (__use_mbox) {
+			ACL_MBOX *mbox = __mboxes[i++ % __nconsumers];
+
+			if (acl_mbox_send(mbox, __msg) < 0) {
+				printf("mbox send error\r\n");
+				break;
+			}
+		} else if (__batch > 1) {
+			for (n = 0; n < __batch && i < count; n++, i++)
+				msgs[n] = __msg;
+			if (acl_fiber_chan_send_batch(__chan, msgs, n) != n)
+				break;
+		} else if (acl_fiber_chan_send(__chan, __msg) < 0) {
+			break;
+		} else
+			i++;
+	}
+
+	if (--thread->nleft == 0)
+		acl_fiber_schedule_stop();
+}
+
+static void *producer(void *ctx)
+{
+	THREAD *thread = (THREAD *) ctx;
+	int i;
+
+	thread->nleft = __nfibers;
+	for (i = 0; i < __nfibers; i++)
+		acl_fiber_create(send_fiber, thread, 64000);
+
+	acl_fiber_schedule();
+	return NULL;
+}
+
+static void recv_fiber(ACL_FIBER *fiber acl_unused, void *ctx)
+{
+	THREAD *thread = (THREAD *) ctx;
+	void  *msgs[64];
+	long long nrecv = 0;
+	int    i, n, stop = 0;
+
+	while (!stop) {
+		if (__use_mbox) {
+			msgs[0] = acl_mbox_read(__mboxes[thread->index], -1, NULL);
+			n = msgs[0] ? 1 : 0;
+		} else if (__batch > 1)
+			n = acl_fiber_chan_recv_batch(__chan, msgs, __batch);
+		else {
+			msgs[0] = acl_fiber_chan_recv(__chan);
+			n = msgs[0] ? 1 : 0;
+		}
+
+		if (n == 0)
+			break;
+
+		for (i = 0; i < n; i++) {
+			if (msgs[i] == __msg)
+				nrecv++;
+			else if (!stop)
+				stop = 1;
+			else	/* for the other consumers */
+				acl_fiber_chan_send(__chan, msgs[i]);
+		}
+	}
+
+	__sync_add_and_fetch(&__nrecv, nrecv);
+	acl_fiber_schedule_stop();
+}
+
+static void *consumer(void *ctx)
+{
+	acl_fiber_create(recv_fiber, ctx, 64000);
+	acl_fiber_schedule();
+	return NULL;
+}
+
+static void usage(const char *procname)
+{
+	printf("usage: %s -h [help]\r\n"
+		" -M [use ACL_MBOX, one for each consumer]\r\n"
+		" -p producer_threads[default: 2]\r\n"
+		" -c consumer_threads[default: 2]\r\n"
+		" -f sending_fibers_each_producer[default: 4]\r\n"
+		" -n messages_count[default: 1000000]\r\n"
+		" -q channel_capacity[default: 1024]\r\n"
+		" -b batch_size[default: 0, max: 64]\r\n", procname);
+}
+
+int main(int argc, char *argv[])
+{
+	int   ch, i;
+	THREAD *producers, *consumers;
+	acl_pthread_t *ptids, *ctids;
+	long long begin, spent;
+
+	while ((ch = getopt(argc, argv, "hMp:c:f:n:q:b:")) > 0) {
+		switch (ch) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'M':
+			__use_mbox = 1;
+			break;
+		case 'p':
+			__nproducers = atoi(optarg);
+			break;
+		case 'c':
+			__nconsumers = atoi(optarg);
+			break;
+		case 'f':
+			__nfibers = atoi(optarg);
+			break;
+		case 'n':
+			__count = atoi(optarg);
+			break;
+		case 'q':
+			__capacity = atoi(optarg);
+			break;
+		case 'b':
+			__batch = atoi(optarg);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (__nproducers <= 0)
+		__nproducers = 1;
+	if (__nconsumers <= 0)
+		__nconsumers = 1;
+	if (__nfibers <= 0)
+		__nfibers = 1;
+	if (__batch > 64)
+		__batch = 64;
+
+	if (__use_mbox) {
+		__mboxes = (ACL_MBOX **) acl_mycalloc(__nconsumers,
+			sizeof(ACL_MBOX *));
+		for (i = 0; i < __nconsumers; i++)
+			__mboxes[i] = acl_mbox_create();
+	} else
+		__chan = acl_fiber_chan_create(__capacity);
+
+	producers = (THREAD *) acl_mycalloc(__nproducers, sizeof(THREAD));
+	consumers = (THREAD *) acl_mycalloc(__nconsumers, sizeof(THREAD));
+	ptids = (acl_pthread_t *) acl_mycalloc(__nproducers,
+		sizeof(acl_pthread_t));
+	ctids = (acl_pthread_t *) acl_mycalloc(__nconsumers,
+		sizeof(acl_pthread_t));
+
+	begin = now_us();
+
+	for (i = 0; i < __nconsumers; i++) {
+		consumers[i].index = i;
+		acl_pthread_create(&ctids[i], NULL, consumer, &consumers[i]);
+	}
+
+	for (i = 0; i < __nproducers; i++) {
+		producers[i].index = i;
+		acl_pthread_create(&ptids[i], NULL, producer, &producers[i]);
+	}
+
+	for (i = 0; i < __nproducers; i++)
+		acl_pthread_join(ptids[i], NULL);
+
+	/* one stop message for each consumer */
+	for (i = 0; i < __nconsumers; i++) {
+		if (__use_mbox)
+			acl_mbox_send(__mboxes[i], __stop);
+		else
+			acl_fiber_chan_send(__chan, __stop);
+	}
+
+	for (i = 0; i < __nconsumers; i++)
+		acl_pthread_join(ctids[i], NULL);
+
+	spent = now_us() - begin;
+
+	printf("%s, producers: %d x %d fibers, consumers: %d, batch: %d, "
+		"messages: %lld, spent: %.2f ms, speed: %.2f/s\r\n",
+		__use_mbox ? "ACL_MBOX" : "ACL_FIBER_CHAN", __nproducers,
+		__nfibers, __nconsumers, __batch, __nrecv, spent / 1000.0,
+		__nrecv * 1000000.0 / (spent > 0 ? spent : 1));
+
+	if (__use_mbox) {
+		for (i = 0; i < __nconsumers; i++)
+			acl_mbox_free(__mboxes[i], NULL);
+		acl_myfree(__mboxes);
+	} else
+		acl_fiber_chan_free(__chan);
+
+	acl_myfree(producers);
+	acl_myfree(consumers);
+	acl_myfree(ptids);
+	acl_myfree(ctids);
+	return 0;
+}
@@ -114,6 +114,7 @@ static void usage(const char *procname)
 		" -r rw_timeout\r\n"
 		" -c max_fibers\r\n"
 		" -w [if wait for echo data from server, dafault: no]\r\n"
+		" -U [use io_uring]\r\n"
 		" -n max_loop\r\n", procname);
 }
 
@@ -126,7 +127,7 @@ int main(int argc, char *argv[])
 
 	snprintf(addr, sizeof(addr), "%s", "0.0.0.0:9002");
 
-	while ((ch = getopt(argc, argv, "hc:n:s:t:r:w")) > 0) {
+	while ((ch = getopt(argc, argv, "hc:n:s:t:r:wU")) > 0) {
 		switch (ch) {
 		case 'h':
 			usage(argv[0]);
@@ -150,6 +151,9 @@ int main(int argc, char *argv[])
 		case 'w':
 			__read_data = 1;
 			break;
+		case 'U':
+			acl_fiber_use_io_uring(1);
+			break;
 		default:
 			break;
 		}
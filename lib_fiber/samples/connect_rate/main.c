@@ -0,0 +1,288 @@
+#include "lib_acl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "fiber/lib_fiber.h"
+
+/* A child process runs the fiber master server in stand alone mode, and
+ * the client threads connect to it as fast as possible, each connection
+ * sends one line, reads the echo and closes; the rate of connections and
+ * how they're spread over the server threads are shown, with the threads
+ * sharing one listening socket or each having its own SO_REUSEPORT one.
+ */
+
+#define	MAX_THREADS	64
+
+static char  __addr[64]    = "127.0.0.1:18892";
+static int   __sthreads    = 4;
+static int   __reuseport   = 0;
+static int   __steer_cpu   = 0;
+static int   __cthreads    = 2;
+static int   __cfibers     = 50;
+static int   __duration    = 3;
+static int   __stop        = 0;
+static long long __nconns  = 0;
+static long long __nerrors = 0;
+
+/* in the server process */
+static int   __nthreads    = 0;
+static long long __accepted[MAX_THREADS];
+static __thread int __index = -1;
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void thread_init(void *ctx acl_unused)
+{
+	__index = __sync_fetch_and_add(&__nthreads, 1) % MAX_THREADS;
+}
+
+static void service(void *ctx acl_unused, ACL_VSTREAM *conn)
+{
+	char buf[1024];
+	int  i, n, ret = acl_vstream_gets(conn, buf, sizeof(buf) - 1);
+
+	if (ret == ACL_VSTREAM_EOF)
+		return;
+
+	if (strncmp(buf, "stat", 4) != 0) {
+		__accepted[__index]++;
+		acl_vstream_writen(conn, buf, ret);
+		return;
+	}
+
+	for (i = 0, n = 0; i < __nthreads && i < MAX_THREADS; i++)
+		n += snprintf(buf + n, sizeof(buf) - n, "%lld ",
+			__accepted[i]);
+	buf[n++] = '\n';
+	acl_vstream_writen(conn, buf, n);
+}
+
+static void server_run(void)
+{
+	char  conf[256], *argv[6];
+	FILE *fp;
+
+	snprintf(conf, sizeof(conf), "./connect_rate.%d.cf", (int) getpid());
+	fp = fopen(conf, "w");
+	if (fp == NULL) {
+		printf("create %s error %s\r\n", conf, acl_last_serror());
+		exit(1);
+	}
+
+	fprintf(fp, "service connect_rate {\n"
+		"\tfiber_threads = %d\n"
+		"\tfiber_backlog = 1024\n"
+		"\tmaster_reuseport = %s\n"
+		"\tfiber_reuseport_cpu = %d\n"
+		"}\n", __sthreads, __reuseport ? "yes" : "no", __steer_cpu);
+	fclose(fp);
+
+	argv[0] = "connect_rate";
+	argv[1] = "-f";
+	argv[2] = conf;
+	argv[3] = "-L";
+	argv[4] = __addr;
+	argv[5] = NULL;
+
+	acl_fiber_server_main(5, argv, service, NULL,
+		ACL_MASTER_SERVER_THREAD_INIT, thread_init,
+		ACL_MASTER_SERVER_END);
+}
+
+static ACL_VSTREAM *client_connect(void)
+{
+	return acl_vstream_connect(__addr, ACL_BLOCKING, 10, 10, 1024);
+}
+
+static void client_fiber(ACL_FIBER *fiber acl_unused, void *ctx)
+{
+	int  *nleft = (int *) ctx;
+	char  buf[256];
+	ACL_VSTREAM *conn;
+
+	while (!__stop) {
+		conn = client_connect();
+		if (conn == NULL) {
+			__sync_add_and_fetch(&__nerrors, 1);
+			acl_fiber_delay(10);
+			continue;
+		}
+
+		if (acl_vstream_writen(conn, "hello\n", 6) == 6
+			&& acl_vstream_gets(conn, buf, sizeof(buf)) > 0)
+			__sync_add_and_fetch(&__nconns, 1);
+		else
+			__sync_add_and_fetch(&__nerrors, 1);
+
+		acl_vstream_close(conn);
+	}
+
+	if (--(*nleft) == 0)
+		acl_fiber_schedule_stop();
+}
+
+static void *client_thread(void *ctx acl_unused)
+{
+	int  i, nleft = __cfibers;
+
+	for (i = 0; i < __cfibers; i++)
+		acl_fiber_create(client_fiber, &nleft, 64000);
+
+	acl_fiber_schedule();
+	return NULL;
+}
+
+/* wait for the server being ready */
+static int server_wait(void)
+{
+	ACL_VSTREAM *conn;
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		if ((conn = client_connect()) != NULL) {
+			acl_vstream_close(conn);
+			return 0;
+		}
+		usleep(50000);
+	}
+
+	return -1;
+}
+
+static void server_stat(void)
+{
+	ACL_VSTREAM *conn = client_connect();
+	char buf[1024];
+
+	if (conn == NULL)
+		return;
+
+	if (acl_vstream_writen(conn, "stat\n", 5) == 5
+		&& acl_vstream_gets_nonl(conn, buf, sizeof(buf)) > 0)
+		printf("accepted by the server threads: %s\r\n", buf);
+
+	acl_vstream_close(conn);
+}
+
+static void usage(const char *procname)
+{
+	printf("usage: %s -h [help]\r\n"
+		" -s server_addr[default: 127.0.0.1:18892]\r\n"
+		" -t server_threads[default: 4]\r\n"
+		" -r [each server thread listens with SO_REUSEPORT]\r\n"
+		" -C [steer the connections to the threads by CPU, with -r]\r\n"
+		" -c client_threads[default: 2]\r\n"
+		" -f fibers_each_client_thread[default: 50]\r\n"
+		" -d duration_seconds[default: 3]\r\n", procname);
+}
+
+int main(int argc, char *argv[])
+{
+	acl_pthread_t tids[MAX_THREADS];
+	long long begin, spent;
+	char  conf[256];
+	pid_t pid;
+	int   ch, i;
+
+	while ((ch = getopt(argc, argv, "hs:t:rCc:f:d:")) > 0) {
+		switch (ch) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 's':
+			ACL_SAFE_STRNCPY(__addr, optarg, sizeof(__addr));
+			break;
+		case 't':
+			__sthreads = atoi(optarg);
+			break;
+		case 'r':
+			__reuseport = 1;
+			break;
+		case 'C':
+			__steer_cpu = 1;
+			break;
+		case 'c':
+			__cthreads = atoi(optarg);
+			break;
+		case 'f':
+			__cfibers = atoi(optarg);
+			break;
+		case 'd':
+			__duration = atoi(optarg);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (__sthreads <= 0)
+		__sthreads = 1;
+	else if (__sthreads > MAX_THREADS)
+		__sthreads = MAX_THREADS;
+	if (__cthreads <= 0)
+		__cthreads = 1;
+	else if (__cthreads > MAX_THREADS)
+		__cthreads = MAX_THREADS;
+
+	/* the server threads can't share one address without SO_REUSEPORT
+	 * in stand alone mode, so one thread accepts for all.
+	 */
+	if (!__reuseport)
+		__sthreads = 1;
+
+	pid = fork();
+	if (pid < 0) {
+		printf("fork error %s\r\n", acl_last_serror());
+		return 1;
+	} else if (pid == 0) {
+		server_run();
+		return 0;
+	}
+
+	snprintf(conf, sizeof(conf), "./connect_rate.%d.cf", (int) pid);
+
+	if (server_wait() < 0) {
+		printf("server %s not ready\r\n", __addr);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		unlink(conf);
+		return 1;
+	}
+
+	begin = now_us();
+
+	for (i = 0; i < __cthreads; i++)
+		acl_pthread_create(&tids[i], NULL, client_thread, NULL);
+
+	sleep(__duration);
+	__stop = 1;
+
+	for (i = 0; i < __cthreads; i++)
+		acl_pthread_join(tids[i], NULL);
+
+	spent = now_us() - begin;
+
+	printf("server threads: %d, reuseport: %s, steer by cpu: %s, "
+		"clients: %d x %d fibers, connections: %lld, errors: %lld, "
+		"spent: %.2f ms, rate: %.2f/s\r\n", __sthreads,
+		__reuseport ? "yes" : "no", __steer_cpu ? "yes" : "no",
+		__cthreads, __cfibers, __nconns, __nerrors, spent / 1000.0,
+		__nconns * 1000000.0 / (spent > 0 ? spent : 1));
+
+	server_stat();
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	unlink(conf);
+	return 0;
+}
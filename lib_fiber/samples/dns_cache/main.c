@@ -0,0 +1,225 @@
+#include "lib_acl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "fiber/lib_fiber.h"
+
+/* A stub DNS server answers the A queries with the TTL given, and answers
+ * NXDOMAIN for the names beginning with "nx"; another one never answers
+ * and is used as the first nameserver. Many fibers resolve the same names
+ * at the same time, and the queries received by the stub server show the
+ * coalescing, the cache hits, the negative caching and the TTL expiring.
+ */
+
+static int  __nfibers = 100;
+static int  __ttl     = 2;
+static int  __nleft   = 0;
+static int  __nqueries = 0;
+static int  __nfailed  = 0;
+static int  __nnodata  = 0;
+static const char *__name = "www.test.local";
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* the socket of the stub servers are used with the syscalls directly, for
+ * they're running in the threads without fibers.
+ */
+static int udp_bind(int *port)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family      = AF_INET;
+	sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+		printf("bind error %s\r\n", acl_last_serror());
+		exit(1);
+	}
+
+	getsockname(fd, (struct sockaddr *) &sa, &len);
+	*port = ntohs(sa.sin_port);
+	return fd;
+}
+
+static void *stub_server(void *ctx)
+{
+	int   fd = (int) (long) ctx, n, qlen;
+	unsigned char buf[512], *ptr;
+	struct sockaddr_in sa;
+	socklen_t len;
+
+	for (;;) {
+		len = sizeof(sa);
+		n = (int) syscall(SYS_recvfrom, fd, buf, sizeof(buf), 0,
+				(struct sockaddr *) &sa, &len);
+		if (n <= 12)
+			continue;
+
+		__sync_add_and_fetch(&__nqueries, 1);
+
+		/* skip the name and the type and class of the question */
+		ptr = buf + 12;
+		while (ptr < buf + n && *ptr != 0)
+			ptr += *ptr + 1;
+		ptr += 5;
+		if (ptr > buf + n)
+			continue;
+		qlen = (int) (ptr - buf);
+
+		buf[2] = 0x81;	/* QR, RD */
+		buf[4] = 0; buf[5] = 1;
+		buf[8] = 0; buf[9] = 0;
+		buf[10] = 0; buf[11] = 0;
+
+		if (buf[13] == 'n' && buf[14] == 'x') {
+			buf[3] = 0x83;	/* RA, NXDOMAIN */
+			buf[6] = 0; buf[7] = 0;
+		} else {
+			buf[3] = 0x80;	/* RA */
+			buf[6] = 0; buf[7] = 2;
+
+			for (n = 1; n <= 2; n++) {
+				*ptr++ = 0xc0; *ptr++ = 12;	/* the name */
+				*ptr++ = 0; *ptr++ = 1;		/* A */
+				*ptr++ = 0; *ptr++ = 1;		/* IN */
+				*ptr++ = 0; *ptr++ = 0;		/* TTL */
+				*ptr++ = (__ttl >> 8) & 0xff;
+				*ptr++ = __ttl & 0xff;
+				*ptr++ = 0; *ptr++ = 4;
+				*ptr++ = 127; *ptr++ = 0; *ptr++ = 0;
+				*ptr++ = (unsigned char) n;
+			}
+			qlen = (int) (ptr - buf);
+		}
+
+		syscall(SYS_sendto, fd, buf, qlen, 0,
+			(struct sockaddr *) &sa, len);
+	}
+
+	return NULL;
+}
+
+static void resolve_fiber(ACL_FIBER *fiber acl_unused, void *ctx)
+{
+	const char *name = (const char *) ctx;
+	struct addrinfo hints, *res = NULL;
+	int   ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+
+	ret = getaddrinfo(name, "80", &hints, &res);
+	if (ret == 0)
+		freeaddrinfo(res);
+	else if (ret == EAI_AGAIN)
+		__nfailed++;
+	else
+		__nnodata++;
+
+	if (--__nleft == 0)
+		acl_fiber_schedule_stop();
+}
+
+static void resolve(const char *title, const char *name)
+{
+	long long begin = now_us();
+	int   i, nqueries = __nqueries;
+
+	__nfailed = __nnodata = 0;
+	__nleft   = __nfibers;
+
+	for (i = 0; i < __nfibers; i++)
+		acl_fiber_create(resolve_fiber, (void *) name, 64000);
+	acl_fiber_schedule();
+
+	printf("%-24s name: %s, fibers: %d, queries: %d, nodata: %d, "
+		"failed: %d, spent: %.2f ms\r\n", title, name, __nfibers,
+		__nqueries - nqueries, __nnodata, __nfailed,
+		(now_us() - begin) / 1000.0);
+}
+
+static void usage(const char *procname)
+{
+	printf("usage: %s -h [help]\r\n"
+		" -n fibers[default: 100]\r\n"
+		" -t ttl_seconds[default: 2]\r\n"
+		" -N name[default: www.test.local]\r\n"
+		" -D [without the dead nameserver]\r\n", procname);
+}
+
+int main(int argc, char *argv[])
+{
+	int   ch, fd, port, dead_fd, dead_port, dead = 1;
+	char  nx[256];
+	acl_pthread_t tid;
+
+	while ((ch = getopt(argc, argv, "hn:t:N:D")) > 0) {
+		switch (ch) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'n':
+			__nfibers = atoi(optarg);
+			break;
+		case 't':
+			__ttl = atoi(optarg);
+			break;
+		case 'N':
+			__name = optarg;
+			break;
+		case 'D':
+			dead = 0;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (__nfibers <= 0)
+		__nfibers = 1;
+
+	fd = udp_bind(&port);
+	acl_pthread_create(&tid, NULL, stub_server, (void *) (long) fd);
+
+	/* the dead server never answers, just for failing over */
+	dead_fd = udp_bind(&dead_port);
+
+	acl_fiber_dns_set_timeout(1, 1);
+	if (dead) {
+		acl_fiber_set_dns("127.0.0.1", dead_port);
+		acl_fiber_add_dns("127.0.0.1", port);
+	} else
+		acl_fiber_set_dns("127.0.0.1", port);
+
+	snprintf(nx, sizeof(nx), "nx.%s", __name);
+
+	resolve("first lookup:", __name);
+	resolve("cached:", __name);
+	resolve("not found:", nx);
+	resolve("not found cached:", nx);
+
+	printf("sleep %d seconds for the TTL\r\n", __ttl + 1);
+	sleep(__ttl + 1);
+	resolve("expired:", __name);
+
+	acl_fiber_dns_clear();
+	resolve("cleared:", __name);
+
+	close(dead_fd);
+	return 0;
+}
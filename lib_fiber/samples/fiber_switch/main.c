@@ -0,0 +1,129 @@
+#include "lib_acl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include "fiber/lib_fiber.h"
+#include "stamp.h"
+
+/* Measure the cost of one fiber context switch: two fibers yield to each
+ * other for max_loop times, which uses the switching backend lib_fiber was
+ * built with (the assembly one by default, -DUSE_JMP or -DUSE_UCONTEXT for
+ * the others); the same ping-pong is also run with the raw swapcontext of
+ * libc for comparing.
+ */
+
+static int __max_loop   = 10000000;
+static int __stack_size = 64000;
+
+static void fiber_main(ACL_FIBER *fiber acl_unused, void *ctx acl_unused)
+{
+	int  i;
+
+	for (i = 0; i < __max_loop; i++)
+		acl_fiber_yield();
+}
+
+static void show_speed(const char *name, long long count,
+	const struct timeval *begin)
+{
+	struct timeval end;
+	double spent;
+
+	gettimeofday(&end, NULL);
+	spent = stamp_sub(&end, begin);
+	printf("%-12s switches: %lld, spent: %.2f ms, speed: %.2f/s, "
+		"%.2f ns/switch\r\n", name, count, spent,
+		(count * 1000) / (spent > 0 ? spent : 1),
+		spent > 0 ? spent * 1000000 / count : 0);
+}
+
+static void test_fiber(void)
+{
+	struct timeval begin;
+
+	acl_fiber_create(fiber_main, NULL, __stack_size);
+	acl_fiber_create(fiber_main, NULL, __stack_size);
+
+	gettimeofday(&begin, NULL);
+	acl_fiber_schedule();
+
+	show_speed("acl_fiber", (long long) __max_loop * 2, &begin);
+}
+
+static ucontext_t __uctx_main, __uctx_a, __uctx_b;
+
+static void uctx_a_main(void)
+{
+	int  i;
+
+	for (i = 0; i < __max_loop; i++)
+		swapcontext(&__uctx_a, &__uctx_b);
+}
+
+static void uctx_b_main(void)
+{
+	for (;;)
+		swapcontext(&__uctx_b, &__uctx_a);
+}
+
+static void test_ucontext(void)
+{
+	char *stack_a = (char *) acl_mymalloc(__stack_size);
+	char *stack_b = (char *) acl_mymalloc(__stack_size);
+	struct timeval begin;
+
+	getcontext(&__uctx_a);
+	__uctx_a.uc_stack.ss_sp   = stack_a;
+	__uctx_a.uc_stack.ss_size = __stack_size;
+	__uctx_a.uc_link          = &__uctx_main;
+	makecontext(&__uctx_a, uctx_a_main, 0);
+
+	getcontext(&__uctx_b);
+	__uctx_b.uc_stack.ss_sp   = stack_b;
+	__uctx_b.uc_stack.ss_size = __stack_size;
+	__uctx_b.uc_link          = &__uctx_main;
+	makecontext(&__uctx_b, uctx_b_main, 0);
+
+	gettimeofday(&begin, NULL);
+	swapcontext(&__uctx_main, &__uctx_a);
+
+	show_speed("swapcontext", (long long) __max_loop * 2, &begin);
+
+	acl_myfree(stack_a);
+	acl_myfree(stack_b);
+}
+
+static void usage(const char *procname)
+{
+	printf("usage: %s -h [help]\r\n"
+		" -n max_loop\r\n"
+		" -d stack_size\r\n", procname);
+}
+
+int main(int argc, char *argv[])
+{
+	int   ch;
+
+	while ((ch = getopt(argc, argv, "hn:d:")) > 0) {
+		switch (ch) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'n':
+			__max_loop = atoi(optarg);
+			break;
+		case 'd':
+			__stack_size = atoi(optarg);
+			break;
+		default:
+			break;
+		}
+	}
+
+	test_fiber();
+	test_ucontext();
+
+	return 0;
+}
@@ -0,0 +1,152 @@
+#include "lib_acl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "fiber/lib_fiber.h"
+
+/* Some worker fibers spin for different times between sleeps, the one with
+ * the largest index is the "hot loop", and the reporter dumps the top
+ * fibers by the running time every second; with -b the cost of the
+ * profiling is shown by the speed of switching between two fibers.
+ */
+
+static int  __nworkers = 10;
+static int  __duration = 3;
+static int  __top      = 5;
+static int  __stop     = 0;
+static int  __nleft    = 0;
+static long long __nswitch = 1000000;
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void fiber_done(void)
+{
+	if (--__nleft == 0)
+		acl_fiber_schedule_stop();
+}
+
+static void worker_main(ACL_FIBER *fiber acl_unused, void *ctx)
+{
+	long long spin = ((long) ctx + 1) * ((long) ctx + 1) * 10, begin;
+
+	while (!__stop) {
+		begin = now_us();
+		while (now_us() - begin < spin) {}
+		acl_fiber_delay(10);
+	}
+
+	fiber_done();
+}
+
+static void reporter_main(ACL_FIBER *fiber acl_unused, void *ctx acl_unused)
+{
+	char buf[4096];
+	int  i;
+
+	for (i = 0; i < __duration; i++) {
+		acl_fiber_sleep(1);
+		acl_fiber_stat_top(buf, sizeof(buf), __top);
+		printf("----- %d -----\r\n%s", i + 1, buf);
+	}
+
+	__stop = 1;
+	fiber_done();
+}
+
+static void yield_main(ACL_FIBER *fiber acl_unused, void *ctx acl_unused)
+{
+	long long i;
+
+	for (i = 0; i < __nswitch; i++)
+		acl_fiber_yield();
+
+	fiber_done();
+}
+
+static void bench_switch(int profile)
+{
+	long long begin, spent;
+
+	acl_fiber_profile(profile);
+
+	acl_fiber_create(yield_main, NULL, 64000);
+	acl_fiber_create(yield_main, NULL, 64000);
+	__nleft = 2;
+
+	begin = now_us();
+	acl_fiber_schedule();
+	spent = now_us() - begin;
+
+	printf("profile %s, switches: %lld, spent: %.2f ms, speed: %.2f/s, "
+		"%.1f ns each\r\n", profile ? "on " : "off", __nswitch * 2,
+		spent / 1000.0, __nswitch * 2 * 1000000.0 / (spent > 0 ? spent : 1),
+		spent * 1000.0 / (__nswitch * 2));
+}
+
+static void usage(const char *procname)
+{
+	printf("usage: %s -h [help]\r\n"
+		" -P [turn on the profiling]\r\n"
+		" -w worker_fibers[default: 10]\r\n"
+		" -t top_fibers[default: 5]\r\n"
+		" -d duration_seconds[default: 3]\r\n"
+		" -b [benchmark the switching with and without profiling]\r\n"
+		" -n yields_of_each_fiber_for_benchmark[default: 1000000]\r\n",
+		procname);
+}
+
+int main(int argc, char *argv[])
+{
+	int  ch, i, bench = 0;
+
+	while ((ch = getopt(argc, argv, "hPw:t:d:bn:")) > 0) {
+		switch (ch) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'P':
+			acl_fiber_profile(1);
+			break;
+		case 'w':
+			__nworkers = atoi(optarg);
+			break;
+		case 't':
+			__top = atoi(optarg);
+			break;
+		case 'd':
+			__duration = atoi(optarg);
+			break;
+		case 'b':
+			bench = 1;
+			break;
+		case 'n':
+			__nswitch = atoll(optarg);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (bench) {
+		bench_switch(0);
+		bench_switch(1);
+		return 0;
+	}
+
+	for (i = 0; i < __nworkers; i++)
+		acl_fiber_create(worker_main, (void *) (long) i, 64000);
+	acl_fiber_create(reporter_main, NULL, 64000);
+
+	__nleft = __nworkers + 1;
+
+	acl_fiber_schedule();
+	return 0;
+}
@@ -0,0 +1,192 @@
+#include "lib_acl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "fiber/lib_fiber.h"
+
+/* Some fibers write the log files and fsync them, and the others just
+ * sleep 1ms in a loop like the fibers serving the requests; the lateness
+ * of the waking up shows how long the thread is blocked by the disk, which
+ * is compared between doing the file IO in the fibers directly and by the
+ * helper threads (or io_uring).
+ */
+
+static int  __nwriters  = 4;
+static int  __nsleepers = 10;
+static int  __nwrites   = 64;	/* the writes before each fsync */
+static int  __wsize     = 65536;
+static int  __duration  = 3;
+static int  __nleft     = 0;
+static int  __stop      = 0;
+static long long *__lates = NULL;
+static int  __nlate = 0;
+static int  __mlate = 0;
+static long long __nwritten = 0;
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void fiber_done(void)
+{
+	if (--__nleft == 0)
+		acl_fiber_schedule_stop();
+}
+
+static void writer_main(ACL_FIBER *fiber acl_unused, void *ctx)
+{
+	char  path[256], *buf = (char *) acl_mymalloc(__wsize);
+	int   fd, i;
+
+	snprintf(path, sizeof(path), "./file_latency.%ld.log", (long) ctx);
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (fd < 0) {
+		printf("open %s error %s\r\n", path, acl_last_serror());
+		acl_myfree(buf);
+		fiber_done();
+		return;
+	}
+
+	memset(buf, 'x', __wsize);
+
+	while (!__stop) {
+		for (i = 0; i < __nwrites; i++) {
+			if (write(fd, buf, __wsize) != __wsize) {
+				printf("write error %s\r\n", acl_last_serror());
+				break;
+			}
+			__nwritten += __wsize;
+		}
+
+		fsync(fd);
+		ftruncate(fd, 0);
+		lseek(fd, 0, SEEK_SET);
+
+		/* the file IO done in the fiber directly never yields */
+		acl_fiber_delay(1);
+	}
+
+	close(fd);
+	unlink(path);
+	acl_myfree(buf);
+	fiber_done();
+}
+
+static void sleeper_main(ACL_FIBER *fiber acl_unused, void *ctx acl_unused)
+{
+	long long begin;
+
+	while (!__stop) {
+		begin = now_us();
+		acl_fiber_delay(1);
+
+		if (__nlate == __mlate) {
+			__mlate = __mlate > 0 ? __mlate * 2 : 10240;
+			__lates = (long long *) acl_myrealloc(__lates,
+				__mlate * sizeof(long long));
+		}
+		__lates[__nlate++] = now_us() - begin - 1000;
+	}
+
+	fiber_done();
+}
+
+static void timer_main(ACL_FIBER *fiber acl_unused, void *ctx acl_unused)
+{
+	acl_fiber_sleep(__duration);
+	__stop = 1;
+	fiber_done();
+}
+
+static int late_cmp(const void *a, const void *b)
+{
+	long long x = *(const long long *) a, y = *(const long long *) b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void usage(const char *procname)
+{
+	printf("usage: %s -h [help]\r\n"
+		" -T file_threads[default: 4, 0 for doing IO in the fibers]\r\n"
+		" -U [use io_uring]\r\n"
+		" -w writer_fibers[default: 4]\r\n"
+		" -s sleeper_fibers[default: 10]\r\n"
+		" -n writes_before_fsync[default: 64]\r\n"
+		" -l write_size[default: 65536]\r\n"
+		" -d duration_seconds[default: 3]\r\n", procname);
+}
+
+int main(int argc, char *argv[])
+{
+	int   ch, i, nthreads = 4;
+
+	while ((ch = getopt(argc, argv, "hT:Uw:s:n:l:d:")) > 0) {
+		switch (ch) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'T':
+			nthreads = atoi(optarg);
+			break;
+		case 'U':
+			acl_fiber_use_io_uring(1);
+			break;
+		case 'w':
+			__nwriters = atoi(optarg);
+			break;
+		case 's':
+			__nsleepers = atoi(optarg);
+			break;
+		case 'n':
+			__nwrites = atoi(optarg);
+			break;
+		case 'l':
+			__wsize = atoi(optarg);
+			break;
+		case 'd':
+			__duration = atoi(optarg);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (__nsleepers <= 0)
+		__nsleepers = 1;
+	if (__wsize <= 0)
+		__wsize = 65536;
+
+	acl_fiber_set_file_threads(nthreads);
+
+	for (i = 0; i < __nwriters; i++)
+		acl_fiber_create(writer_main, (void *) (long) i, 64000);
+	for (i = 0; i < __nsleepers; i++)
+		acl_fiber_create(sleeper_main, NULL, 64000);
+	acl_fiber_create(timer_main, NULL, 64000);
+
+	__nleft = __nwriters + __nsleepers + 1;
+
+	acl_fiber_schedule();
+
+	if (__nlate == 0)
+		return 0;
+
+	qsort(__lates, __nlate, sizeof(long long), late_cmp);
+
+	printf("file threads: %d, writers: %d, written: %lld MB, "
+		"sleeps: %d, late(us) p50: %lld, p99: %lld, p99.9: %lld, "
+		"max: %lld\r\n", nthreads, __nwriters, __nwritten / 1048576,
+		__nlate, __lates[__nlate / 2], __lates[(int) (__nlate * 0.99)],
+		__lates[(int) (__nlate * 0.999)], __lates[__nlate - 1]);
+
+	acl_myfree(__lates);
+	return 0;
+}
@@ -0,0 +1,304 @@
+#include "lib_acl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "fiber/lib_fiber.h"
+
+/* The skewed load: a few "hot" connections cost much more CPU for each
+ * request than the others, and all of them are put in the first thread
+ * when each thread schedules its own fibers, just like some heavy clients
+ * connecting to one of the threads of a server. The latency of the light
+ * requests is measured by the client threads, and compared with the M:N
+ * mode in which the idle threads steal the ready fibers from the busy one.
+ */
+
+typedef struct THREAD THREAD;
+
+typedef struct {
+	THREAD *thread;
+	int     sfd;		/* the server side of the socketpair */
+	int     cfd;		/* the client side */
+	int     work;		/* the CPU cost for each request in us */
+	int     hot;
+	long long *lats;	/* the latency of each request in us */
+	int     nlat;
+	int     mlat;
+} CONN;
+
+struct THREAD {
+	acl_pthread_t tid;
+	CONN  **conns;
+	int     nconn;
+	int     nleft;
+};
+
+static int  __nthreads  = 4;
+static int  __nconns    = 64;
+static int  __nhot      = 2;
+static int  __hot_work  = 2000;
+static int  __light_work = 10;
+static int  __duration  = 3;
+static int  __stack     = 64000;
+static volatile int __stop = 0;
+static CONN **__conns = NULL;
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void busy(int us)
+{
+	long long end = now_us() + us;
+
+	while (now_us() < end) {}
+}
+
+static void echo_fiber(ACL_FIBER *fiber acl_unused, void *ctx)
+{
+	CONN *conn = (CONN *) ctx;
+	char  buf[8];
+	ssize_t n;
+
+	for (;;) {
+		n = read(conn->sfd, buf, sizeof(buf));
+		if (n <= 0)
+			break;
+
+		busy(conn->work);
+
+		if (write(conn->sfd, buf, n) != n)
+			break;
+	}
+
+	close(conn->sfd);
+
+	/* in M:N mode the scheduling stops when all the fibers exit */
+	if (conn->thread && --conn->thread->nleft == 0)
+		acl_fiber_schedule_stop();
+}
+
+static void *client_thread(void *ctx)
+{
+	CONN *conn = (CONN *) ctx;
+	long long begin;
+	char  ch = 'x';
+
+	while (!__stop) {
+		begin = now_us();
+
+		if (write(conn->cfd, &ch, 1) != 1)
+			break;
+		if (read(conn->cfd, &ch, 1) != 1)
+			break;
+
+		if (conn->nlat == conn->mlat) {
+			conn->mlat = conn->mlat > 0 ? conn->mlat * 2 : 1024;
+			conn->lats = (long long *) acl_myrealloc(conn->lats,
+				conn->mlat * sizeof(long long));
+		}
+		conn->lats[conn->nlat++] = now_us() - begin;
+	}
+
+	close(conn->cfd);
+	return NULL;
+}
+
+static void *server_thread(void *ctx)
+{
+	THREAD *thread = (THREAD *) ctx;
+	int i;
+
+	for (i = 0; i < thread->nconn; i++)
+		acl_fiber_create(echo_fiber, thread->conns[i], __stack);
+
+	acl_fiber_schedule();
+	return NULL;
+}
+
+static void *mn_thread(void *ctx acl_unused)
+{
+	int i;
+
+	for (i = 0; i < __nconns; i++)
+		acl_fiber_create(echo_fiber, __conns[i], __stack);
+
+	acl_fiber_schedule_mn(__nthreads);
+	return NULL;
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	long long x = *(const long long *) a, y = *(const long long *) b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void report(CONN **conns, int hot, double spent)
+{
+	long long *lats, total = 0;
+	int i, j, n = 0;
+
+	for (i = 0; i < __nconns; i++) {
+		if (conns[i]->hot == hot)
+			n += conns[i]->nlat;
+	}
+
+	if (n == 0)
+		return;
+
+	lats = (long long *) acl_mymalloc(n * sizeof(long long));
+	for (i = 0, n = 0; i < __nconns; i++) {
+		if (conns[i]->hot != hot)
+			continue;
+		for (j = 0; j < conns[i]->nlat; j++) {
+			lats[n++] = conns[i]->lats[j];
+			total += conns[i]->lats[j];
+		}
+	}
+
+	qsort(lats, n, sizeof(long long), lat_cmp);
+
+	printf("%s requests: %d, speed: %.2f/s, latency(us) avg: %.1f, "
+		"p50: %lld, p99: %lld, p99.9: %lld, max: %lld\r\n",
+		hot ? "hot  " : "light", n, n * 1000.0 / spent,
+		(double) total / n, lats[n / 2], lats[(int) (n * 0.99)],
+		lats[(int) (n * 0.999)], lats[n - 1]);
+
+	acl_myfree(lats);
+}
+
+static void usage(const char *procname)
+{
+	printf("usage: %s -h [help]\r\n"
+		" -M [use the M:N scheduling, default: one scheduler each thread]\r\n"
+		" -t threads[default: 4]\r\n"
+		" -c connections[default: 64]\r\n"
+		" -o hot_connections[default: 2]\r\n"
+		" -w hot_work_us[default: 2000]\r\n"
+		" -l light_work_us[default: 10]\r\n"
+		" -d duration_seconds[default: 3]\r\n", procname);
+}
+
+int main(int argc, char *argv[])
+{
+	int   ch, i, mn = 0, sv[2];
+	CONN **conns;
+	THREAD *threads;
+	acl_pthread_t *tids, mn_tid;
+	long long begin;
+	double spent;
+
+	while ((ch = getopt(argc, argv, "hMt:c:o:w:l:d:")) > 0) {
+		switch (ch) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'M':
+			mn = 1;
+			break;
+		case 't':
+			__nthreads = atoi(optarg);
+			break;
+		case 'c':
+			__nconns = atoi(optarg);
+			break;
+		case 'o':
+			__nhot = atoi(optarg);
+			break;
+		case 'w':
+			__hot_work = atoi(optarg);
+			break;
+		case 'l':
+			__light_work = atoi(optarg);
+			break;
+		case 'd':
+			__duration = atoi(optarg);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (__nthreads <= 0)
+		__nthreads = 1;
+	if (__nconns <= 0)
+		__nconns = 1;
+	if (__nhot > __nconns)
+		__nhot = __nconns;
+
+	threads = (THREAD *) acl_mycalloc(__nthreads, sizeof(THREAD));
+	for (i = 0; i < __nthreads; i++)
+		threads[i].conns = (CONN **) acl_mycalloc(__nconns,
+			sizeof(CONN *));
+
+	/* the hot connections are all in the first thread, and the light
+	 * ones are distributed to all the threads
+	 */
+	conns = __conns = (CONN **) acl_mycalloc(__nconns, sizeof(CONN *));
+	for (i = 0; i < __nconns; i++) {
+		THREAD *thread;
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+			printf("socketpair error %s\r\n", acl_last_serror());
+			return 1;
+		}
+
+		conns[i] = (CONN *) acl_mycalloc(1, sizeof(CONN));
+		conns[i]->sfd  = sv[0];
+		conns[i]->cfd  = sv[1];
+		conns[i]->hot  = i < __nhot;
+		conns[i]->work = conns[i]->hot ? __hot_work : __light_work;
+		acl_non_blocking(sv[0], ACL_NON_BLOCKING);
+
+		thread = &threads[conns[i]->hot ? 0 : i % __nthreads];
+		thread->conns[thread->nconn++] = conns[i];
+		thread->nleft++;
+		if (!mn)
+			conns[i]->thread = thread;
+	}
+
+	tids = (acl_pthread_t *) acl_mycalloc(__nconns, sizeof(acl_pthread_t));
+	for (i = 0; i < __nconns; i++)
+		acl_pthread_create(&tids[i], NULL, client_thread, conns[i]);
+
+	begin = now_us();
+
+	if (mn)
+		acl_pthread_create(&mn_tid, NULL, mn_thread, NULL);
+	else {
+		for (i = 0; i < __nthreads; i++)
+			acl_pthread_create(&threads[i].tid, NULL,
+				server_thread, &threads[i]);
+	}
+
+	sleep(__duration);
+	__stop = 1;
+	spent = (now_us() - begin) / 1000.0;
+
+	/* the fibers exit after the clients closing the connections */
+	for (i = 0; i < __nconns; i++)
+		acl_pthread_join(tids[i], NULL);
+
+	if (mn)
+		acl_pthread_join(mn_tid, NULL);
+	else {
+		for (i = 0; i < __nthreads; i++)
+			acl_pthread_join(threads[i].tid, NULL);
+	}
+
+	printf("%s, threads: %d, connections: %d, hot: %d, "
+		"hot work: %d us, light work: %d us\r\n",
+		mn ? "M:N scheduling" : "fixed threads", __nthreads,
+		__nconns, __nhot, __hot_work, __light_work);
+	report(conns, 0, spent);
+	report(conns, 1, spent);
+
+	return 0;
+}
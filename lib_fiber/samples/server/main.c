@@ -96,6 +96,7 @@ static void usage(const char *procname)
 		"  -S [if sleep]\r\n"
 		"  -q listen_queue\r\n"
 		"  -z stack_size\r\n"
+		"  -U [use io_uring]\r\n"
 		"  -w [if echo data, default: no]\r\n", procname);
 }
 
@@ -109,7 +110,7 @@ int main(int argc, char *argv[])
 
 	snprintf(addr, sizeof(addr), "%s", "127.0.0.1:9002");
 
-	while ((ch = getopt(argc, argv, "hs:r:Sq:wz:")) > 0) {
+	while ((ch = getopt(argc, argv, "hs:r:Sq:wz:U")) > 0) {
 		switch (ch) {
 		case 'h':
 			usage(argv[0]);
@@ -132,6 +133,9 @@ int main(int argc, char *argv[])
 		case 'z':
 			__stack_size = atoi(optarg);
 			break;
+		case 'U':
+			acl_fiber_use_io_uring(1);
+			break;
 		default:
 			break;
 		}
@@ -0,0 +1,160 @@
+#include "lib_acl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fiber/lib_fiber.h"
+#include "stamp.h"
+
+/* Lots of mostly idle fibers, just like the long connections waiting for
+ * the messages: each one uses some of its stack and sleeps for some loops.
+ * The resident memory is compared between the fibers with their own
+ * stacks and the ones using the shared stack.
+ */
+
+static int __fibers_count = 100000;
+static int __fibers_left  = 100000;
+static int __max_loop     = 5;
+static int __sleep_ms     = 1000;
+static int __stack_used   = 1024;
+static long long __nsleep = 0;
+static struct timeval __begin;
+
+static long rss_kb(void)
+{
+	char  line[256];
+	long  kb = -1;
+	FILE *fp = fopen("/proc/self/status", "r");
+
+	if (fp == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "VmRSS:", 6) == 0) {
+			kb = atol(line + 6);
+			break;
+		}
+	}
+
+	fclose(fp);
+	return kb;
+}
+
+static int use_stack(int n)
+{
+	char buf[256];
+	int  i, sum = 0;
+
+	memset(buf, n, sizeof(buf));
+	if (n > (int) sizeof(buf))
+		sum = use_stack(n - (int) sizeof(buf));
+	for (i = 0; i < (int) sizeof(buf); i += 64)
+		sum += buf[i];
+	return sum;
+}
+
+static void idle_main(ACL_FIBER *fiber acl_unused, void *ctx acl_unused)
+{
+	int  i;
+
+	for (i = 0; i < __max_loop; i++) {
+		(void) use_stack(__stack_used);
+		acl_fiber_delay(__sleep_ms);
+		__nsleep++;
+	}
+
+	if (--__fibers_left == 0) {
+		struct timeval end;
+		double spent;
+
+		gettimeofday(&end, NULL);
+		spent = stamp_sub(&end, &__begin);
+		printf("fibers: %d, sleep: %lld, spent: %.2f ms\r\n",
+			__fibers_count, __nsleep, spent);
+
+		acl_fiber_schedule_stop();
+	}
+}
+
+static void monitor_main(ACL_FIBER *fiber acl_unused, void *ctx acl_unused)
+{
+	acl_fiber_delay(__sleep_ms / 2);
+	printf("fibers: %d, rss: %ld KB, %.2f KB per fiber\r\n",
+		__fibers_count, rss_kb(),
+		(double) rss_kb() / __fibers_count);
+}
+
+static void usage(const char *procname)
+{
+	printf("usage: %s -h [help]\r\n"
+		" -S [use the shared stack]\r\n"
+		" -c fibers_count[default: 100000]\r\n"
+		" -n max_loop[default: 5]\r\n"
+		" -m sleep_ms[default: 1000]\r\n"
+		" -u stack_used_bytes[default: 1024]\r\n"
+		" -s stack_size[default: 64000]\r\n"
+		" -z shared_stack_size[default: 1024000]\r\n", procname);
+}
+
+int main(int argc, char *argv[])
+{
+	int   ch, i, share = 0, stack_size = 64000;
+	struct timeval end;
+
+	while ((ch = getopt(argc, argv, "hSc:n:m:u:s:z:")) > 0) {
+		switch (ch) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'S':
+			share = 1;
+			break;
+		case 'c':
+			__fibers_count = atoi(optarg);
+			break;
+		case 'n':
+			__max_loop = atoi(optarg);
+			break;
+		case 'm':
+			__sleep_ms = atoi(optarg);
+			break;
+		case 'u':
+			__stack_used = atoi(optarg);
+			break;
+		case 's':
+			stack_size = atoi(optarg);
+			break;
+		case 'z':
+			acl_fiber_set_shared_stack_size((size_t) atoi(optarg));
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (__fibers_count <= 0)
+		__fibers_count = 1;
+	__fibers_left = __fibers_count;
+
+	printf("rss: %ld KB before creating fibers\r\n", rss_kb());
+
+	gettimeofday(&__begin, NULL);
+
+	for (i = 0; i < __fibers_count; i++) {
+		if (share)
+			acl_fiber_create_shared(idle_main, NULL);
+		else
+			acl_fiber_create(idle_main, NULL, stack_size);
+	}
+
+	acl_fiber_create(monitor_main, NULL, 64000);
+
+	gettimeofday(&end, NULL);
+	printf("create %d fibers with %s, spent: %.2f ms\r\n",
+		__fibers_count, share ? "the shared stack" : "their own stacks",
+		stamp_sub(&end, &__begin));
+
+	acl_fiber_schedule();
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+#include "lib_acl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fiber/lib_fiber.h"
+#include "stamp.h"
+
+/* Many fibers sleeping at the same time, each one sleeps for a random
+ * time in milliseconds for some loops, which measures the cost of adding
+ * and expiring the fiber timers when lots of fibers are sleeping.
+ */
+
+static int __fibers_count = 100000;
+static int __fibers_left  = 100000;
+static int __max_sleep    = 1000;
+static int __max_loop     = 2;
+static long long __late   = 0;
+static long long __nsleep = 0;
+static struct timeval __begin;
+
+static void sleep_main(ACL_FIBER *fiber acl_unused, void *ctx acl_unused)
+{
+	int  i, n;
+
+	for (i = 0; i < __max_loop; i++) {
+		n = 1 + rand() % __max_sleep;
+		__late += acl_fiber_delay(n);
+		__nsleep++;
+	}
+
+	if (--__fibers_left == 0) {
+		struct timeval end;
+		double spent;
+
+		gettimeofday(&end, NULL);
+		spent = stamp_sub(&end, &__begin);
+		printf("fibers: %d, sleep: %lld, spent: %.2f ms, "
+			"speed: %.2f/s, late: %.2f ms per sleep\r\n",
+			__fibers_count, __nsleep, spent,
+			(__nsleep * 1000) / (spent > 0 ? spent : 1),
+			__nsleep > 0 ? (double) __late / __nsleep : 0);
+
+		acl_fiber_schedule_stop();
+	}
+}
+
+static void usage(const char *procname)
+{
+	printf("usage: %s -h [help]\r\n"
+		" -c fibers_count[default: 100000, try 1000000]\r\n"
+		" -n max_loop[default: 2]\r\n"
+		" -m max_sleep_ms[default: 1000]\r\n"
+		" -s stack_size[default: 8192]\r\n", procname);
+}
+
+int main(int argc, char *argv[])
+{
+	int   ch, i, stack_size = 8192;
+	struct timeval end;
+
+	while ((ch = getopt(argc, argv, "hc:n:m:s:")) > 0) {
+		switch (ch) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'c':
+			__fibers_count = atoi(optarg);
+			break;
+		case 'n':
+			__max_loop = atoi(optarg);
+			break;
+		case 'm':
+			__max_sleep = atoi(optarg);
+			break;
+		case 's':
+			stack_size = atoi(optarg);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (__fibers_count <= 0)
+		__fibers_count = 1;
+	if (__max_sleep <= 0)
+		__max_sleep = 1;
+	__fibers_left = __fibers_count;
+
+	gettimeofday(&__begin, NULL);
+
+	for (i = 0; i < __fibers_count; i++)
+		acl_fiber_create(sleep_main, NULL, stack_size);
+
+	gettimeofday(&end, NULL);
+	printf("create %d fibers, spent: %.2f ms\r\n",
+		__fibers_count, stamp_sub(&end, &__begin));
+
+	acl_fiber_schedule();
+
+	return 0;
+}